@@ -0,0 +1,237 @@
+/*
+ * Micro-benchmark for get_frame_brightness() (camera.h), shared by Camera and Pipewire sensors,
+ * against the previous two-pass implementation, on synthetic GREY, YUYV and decoded MJPEG frames.
+ *
+ * Usage: histogram_bench [-n iterations]
+ */
+
+#include "camera.h"
+#include <getopt.h>
+#include <jpeglib.h>
+
+#define BENCH_ITERATIONS    200
+
+typedef enum { FMT_GREY, FMT_YUYV, FMT_MJPEG, FMT_NUM } bench_fmt;
+
+static const char *fmt_names[FMT_NUM] = { "GREY", "YUYV", "MJPEG" };
+static const int sizes[][2] = { { 160, 120 }, { 640, 480 }, { 1920, 1080 } };
+
+/* camera.h only needs it to store camera settings, unused here */
+static struct v4l2_control *set_camera_setting(void *priv, uint32_t op, float val, const char *op_name, bool store) {
+    return NULL;
+}
+
+/* Previous implementation: min/max pass, then a per-pixel floating point bucketing pass */
+static double legacy_frame_brightness(uint8_t *img_data, rect_info_t *full, bool is_yuv) {
+    double brightness = 0.0;
+    double min = CAMERA_ILL_MAX;
+    double max = 0.0;
+    const int inc = 1 + is_yuv;
+
+    rect_info_t crop_rect;
+    get_crop_rect(full, &crop_rect);
+
+    int total = 0;
+    for (int row = crop_rect.row_start; row < crop_rect.row_end; row++) {
+        for (int col = crop_rect.col_start * inc; col < crop_rect.col_end * inc; col += inc) {
+            const int idx = (row * full->col_end * inc) + col;
+            if (img_data[idx] < min) {
+                min = img_data[idx];
+            }
+            if (img_data[idx] > max) {
+                max = img_data[idx];
+            }
+            total++;
+        }
+    }
+
+    if (max == 0.0) {
+        return brightness;
+    }
+
+    struct histogram hist[HISTOGRAM_STEPS] = {0};
+    const double step_size = (max - min) / HISTOGRAM_STEPS;
+    for (int row = crop_rect.row_start; row < crop_rect.row_end; row++) {
+        for (int col = crop_rect.col_start * inc; col < crop_rect.col_end * inc; col += inc) {
+            const int idx = (row * full->col_end * inc) + col;
+            int bucket = (img_data[idx] - min) / step_size;
+            if (bucket >= 0 && bucket < HISTOGRAM_STEPS) {
+                hist[bucket].sum += img_data[idx];
+                hist[bucket].count++;
+            }
+        }
+    }
+
+    const double quartile_size = (double)total / 4;
+    double quartiles[3] = {0};
+    int j = 0;
+    for (int i = 0; i < HISTOGRAM_STEPS && j < 3; i++) {
+        quartiles[j] += hist[i].count;
+        if (quartiles[j] >= quartile_size) {
+            quartiles[j] = (quartile_size / quartiles[j]) + i;
+            j++;
+        }
+    }
+
+    int min_bucket = 0;
+    int max_bucket = HISTOGRAM_STEPS - 1;
+    if (quartiles[2] > quartiles[0]) {
+        const double iqr = (quartiles[2] - quartiles[0]) * 1.5;
+        min_bucket = quartiles[0] - iqr;
+        max_bucket = quartiles[2] + iqr;
+        if (min_bucket < 0) {
+            min_bucket = 0;
+        }
+        if (max_bucket > HISTOGRAM_STEPS - 1) {
+            max_bucket = HISTOGRAM_STEPS - 1;
+        }
+    }
+
+    for (int i = max_bucket; i >= min_bucket; i--) {
+        if (hist[i].count > step_size) {
+            brightness = hist[i].sum / hist[i].count;
+            break;
+        }
+    }
+    return (double)brightness / CAMERA_ILL_MAX;
+}
+
+/* Deterministic scene: a diagonal gradient with some noise and a bright window */
+static uint8_t scene_luma(int x, int y, int width, int height, uint32_t *seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    int v = 40 + 120 * (x + y) / (width + height) + (int)(*seed % 24);
+    if (x > width / 2 && x < width * 3 / 4 && y < height / 3) {
+        v = 230 + (int)(*seed % 16);
+    }
+    return v > CAMERA_ILL_MAX ? CAMERA_ILL_MAX : v;
+}
+
+/* Compress a GREY frame and decode it back, as Camera does for MJPEG frames */
+static int jpeg_roundtrip(uint8_t *grey, int width, int height) {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr err;
+    cinfo.err = jpeg_std_error(&err);
+    jpeg_create_compress(&cinfo);
+    unsigned char *jpeg = NULL;
+    unsigned long jpeg_size = 0;
+    jpeg_mem_dest(&cinfo, &jpeg, &jpeg_size);
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 1;
+    cinfo.in_color_space = JCS_GRAYSCALE;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 80, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = grey + cinfo.next_scanline * width;
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    struct jpeg_decompress_struct dinfo;
+    dinfo.err = jpeg_std_error(&err);
+    jpeg_create_decompress(&dinfo);
+    jpeg_mem_src(&dinfo, jpeg, jpeg_size);
+    jpeg_read_header(&dinfo, TRUE);
+    dinfo.out_color_space = JCS_GRAYSCALE;
+    jpeg_start_decompress(&dinfo);
+    while (dinfo.output_scanline < dinfo.output_height) {
+        JSAMPROW row = grey + dinfo.output_scanline * width;
+        jpeg_read_scanlines(&dinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&dinfo);
+    jpeg_destroy_decompress(&dinfo);
+    free(jpeg);
+    return (int)jpeg_size;
+}
+
+static uint8_t *create_frame(bench_fmt fmt, int width, int height) {
+    const bool is_yuv = fmt == FMT_YUYV;
+    uint8_t *frame = malloc((size_t)width * height * (1 + is_yuv));
+    if (!frame) {
+        return NULL;
+    }
+    uint32_t seed = 2463534242;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const uint8_t luma = scene_luma(x, y, width, height, &seed);
+            if (is_yuv) {
+                frame[2 * (y * width + x)] = luma;
+                frame[2 * (y * width + x) + 1] = 128 + (x % 2 ? 8 : -8); // U/V
+            } else {
+                frame[y * width + x] = luma;
+            }
+        }
+    }
+    if (fmt == FMT_MJPEG) {
+        jpeg_roundtrip(frame, width, height);
+    }
+    return frame;
+}
+
+typedef double (*brightness_fn)(uint8_t *, rect_info_t *, int, bool);
+
+static double bench_ns(volatile brightness_fn fn, uint8_t *frame,
+                       rect_info_t *full, int stride, bool is_yuv, int iterations, double *pct) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations; i++) {
+        /* Frame may have changed: computation cannot be hoisted out of the loop */
+        __asm__ volatile("" : : "g"(frame) : "memory");
+        *pct = fn(frame, full, stride, is_yuv);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / iterations;
+}
+
+/* Same signature as get_frame_brightness(), to be timed by bench_ns() */
+static double legacy(uint8_t *img_data, rect_info_t *full, int stride, bool is_yuv) {
+    return legacy_frame_brightness(img_data, full, is_yuv);
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = BENCH_ITERATIONS;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n' && strtol(optarg, NULL, 10) > 0) {
+            iterations = strtol(optarg, NULL, 10);
+        } else {
+            fprintf(stderr, "Usage: %s [-n iterations]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("%d iterations per frame\n", iterations);
+    printf("%-6s %10s %14s %14s %9s %9s %9s\n", "fmt", "size", "legacy (us)", "current (us)", "speedup",
+           "legacy", "current");
+
+    int ret = EXIT_SUCCESS;
+    for (int f = 0; f < FMT_NUM; f++) {
+        for (int s = 0; s < SIZE(sizes); s++) {
+            const int width = sizes[s][0];
+            const int height = sizes[s][1];
+            const bool is_yuv = f == FMT_YUYV;
+            uint8_t *frame = create_frame(f, width, height);
+            if (!frame) {
+                return EXIT_FAILURE;
+            }
+            rect_info_t full = { .row_end = height, .col_end = width };
+            double old_pct = 0.0, new_pct = 0.0;
+            const double old_ns = bench_ns(legacy, frame, &full, width * (1 + is_yuv), is_yuv, iterations, &old_pct);
+            const double new_ns = bench_ns(get_frame_brightness, frame, &full, width * (1 + is_yuv), is_yuv, iterations, &new_pct);
+            char size[16];
+            snprintf(size, sizeof(size), "%dx%d", width, height);
+            printf("%-6s %10s %14.1lf %14.1lf %8.1lfx %9.4lf %9.4lf\n", fmt_names[f], size,
+                   old_ns / 1000, new_ns / 1000, old_ns / new_ns, old_pct, new_pct);
+            if (old_pct != new_pct) {
+                fprintf(stderr, "Brightness mismatch for %s %s.\n", fmt_names[f], size);
+                ret = EXIT_FAILURE;
+            }
+            free(frame);
+        }
+    }
+    return ret;
+}
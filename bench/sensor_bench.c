@@ -0,0 +1,228 @@
+/*
+ * Replay harness for sensor plugins:
+ * drives the very same capture() code paths used by Clightd,
+ * against local stand-ins for real hardware (see bench/README.md),
+ * reporting per-stage latency and allocations per capture.
+ * Like sensor module, interval-paced sensors are asked for a single sample
+ * each interval ms, while the others are asked for all samples at once.
+ *
+ * Usage: sensor_bench [-n captures] [-c samples] [-s settings] sensor [interface]
+ */
+
+#include <sensor.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+
+#define BENCH_MAX_SENSORS   SENSOR_NUM
+#define BENCH_MAX_STAGES    16
+#define BENCH_MAX_SAMPLES   64
+#define BENCH_SETTINGS_LEN  256
+
+typedef struct {
+    const char *name;
+    uint64_t count;
+    double total;       // ms
+    double max;         // ms
+} bench_stage_t;
+
+/* Globals otherwise provided by main.c */
+struct udev *udev;
+sd_bus *bus;
+
+static sensor_t *sensors[BENCH_MAX_SENSORS];
+static bench_stage_t stages[BENCH_MAX_STAGES];
+static int num_stages;
+static uint64_t num_allocs;
+
+/*
+ * Count any heap allocation made by the process, including the ones
+ * made by libjpeg, libiio and libudev on our behalf.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+    __atomic_add_fetch(&num_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    __atomic_add_fetch(&num_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    __atomic_add_fetch(&num_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+static inline double elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+static void record(const char *name, double ms) {
+    int i;
+    for (i = 0; i < num_stages && strcmp(stages[i].name, name) != 0; i++);
+    if (i == num_stages) {
+        if (num_stages == BENCH_MAX_STAGES) {
+            return;
+        }
+        stages[num_stages++].name = name;
+    }
+    stages[i].count++;
+    stages[i].total += ms;
+    if (ms > stages[i].max) {
+        stages[i].max = ms;
+    }
+}
+
+/** sensor.h API **/
+void sensor_register_new(sensor_t *sensor) {
+    for (int i = 0; i < BENCH_MAX_SENSORS; i++) {
+        if (!sensors[i]) {
+            sensors[i] = sensor;
+            break;
+        }
+    }
+}
+
+void sensor_emit_light_changed(const char *name, const char *node, double pct) {
+
+}
+
+void sensor_bench_stage(const char *stage, const struct timespec *start) {
+    record(stage, elapsed_ms(start));
+}
+/** sensor.h API **/
+
+static sensor_t *find_sensor(const char *name) {
+    for (int i = 0; i < BENCH_MAX_SENSORS && sensors[i]; i++) {
+        if (!strcasecmp(sensors[i]->name, name)) {
+            return sensors[i];
+        }
+    }
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n captures] [-c samples] [-s settings] sensor [interface]\n", prog);
+    fprintf(stderr, "Available sensors:");
+    for (int i = 0; i < BENCH_MAX_SENSORS && sensors[i]; i++) {
+        fprintf(stderr, " %s", sensors[i]->name);
+    }
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[]) {
+    int num_runs = 100;
+    int num_samples = 1;
+    const char *settings = "";
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c:s:")) != -1) {
+        switch (opt) {
+            case 'n':
+                num_runs = strtol(optarg, NULL, 10);
+                break;
+            case 'c':
+                num_samples = strtol(optarg, NULL, 10);
+                break;
+            case 's':
+                settings = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc || num_runs <= 0 || num_samples <= 0 || num_samples > BENCH_MAX_SAMPLES
+        || strlen(settings) >= BENCH_SETTINGS_LEN) {
+
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    sensor_t *sensor = find_sensor(argv[optind]);
+    if (!sensor) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *interface = optind + 1 < argc ? argv[optind + 1] : NULL;
+
+    udev = udev_new();
+    /* Some sensors need their monitor to keep track of devices state */
+    const int mon_fd = sensor->init_monitor();
+    void *dev = NULL;
+    sensor->fetch_dev(interface, &dev);
+    if (!dev) {
+        fprintf(stderr, "No %s device found.\n", sensor->name);
+        sensor->destroy_monitor();
+        udev_unref(udev);
+        return EXIT_FAILURE;
+    }
+    const char *node = NULL;
+    sensor->fetch_props_dev(dev, &node, NULL);
+    printf("%s device: %s | %d captures of %d samples | settings: '%s' | monitor fd: %d\n",
+           sensor->name, node, num_runs, num_samples, settings, mon_fd);
+
+    /* Settings are tokenized in place by sensors */
+    char set[BENCH_SETTINGS_LEN];
+    strcpy(set, settings);
+    const int interval = sensor->capture_interval(dev, set);
+    const int num_calls = interval > 0 ? num_samples : 1;
+    const int call_samples = interval > 0 ? 1 : num_samples;
+    printf("%d capture() call(s) of %d sample(s) per capture, %d ms apart\n", num_calls, call_samples, interval);
+
+    double pct[BENCH_MAX_SAMPLES];
+    uint64_t ts[BENCH_MAX_SAMPLES];
+    uint64_t allocs = 0, samples = 0;
+    double mean_pct = 0.0;
+    for (int i = 0; i < num_runs; i++) {
+        struct timespec next;
+        clock_gettime(CLOCK_MONOTONIC, &next);
+        for (int k = 0; k < num_calls; k++) {
+            if (k > 0) {
+                /* Same pacing as sensor module capture timer */
+                next.tv_sec += interval / 1000;
+                next.tv_nsec += (interval % 1000) * 1000000L;
+                if (next.tv_nsec >= 1000000000L) {
+                    next.tv_sec++;
+                    next.tv_nsec -= 1000000000L;
+                }
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+            }
+            strcpy(set, settings);
+
+            const uint64_t allocs_start = __atomic_load_n(&num_allocs, __ATOMIC_RELAXED);
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            const int ret = sensor->capture(dev, pct, ts, call_samples, set);
+            record("capture", elapsed_ms(&start));
+            allocs += __atomic_load_n(&num_allocs, __ATOMIC_RELAXED) - allocs_start;
+
+            for (int j = 0; j < ret; j++) {
+                mean_pct += pct[j];
+            }
+            if (ret > 0) {
+                samples += ret;
+            }
+        }
+    }
+
+    printf("%-12s %10s %12s %12s\n", "stage", "calls", "mean (ms)", "max (ms)");
+    for (int i = 0; i < num_stages; i++) {
+        printf("%-12s %10"PRIu64" %12.3lf %12.3lf\n", stages[i].name, stages[i].count,
+               stages[i].total / stages[i].count, stages[i].max);
+    }
+    printf("allocations per capture() call: %.2lf\n", (double)allocs / ((uint64_t)num_runs * num_calls));
+    printf("samples: %"PRIu64"/%"PRIu64" | mean brightness: %.3lf\n", samples, (uint64_t)num_runs * num_samples,
+           samples ? mean_pct / samples : NAN);
+
+    sensor->destroy_dev(dev);
+    sensor->destroy_monitor();
+    udev_unref(udev);
+    return samples > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -31,8 +31,11 @@ typedef struct bl {
     bool is_internal;
     bool is_ddc;
     bool is_emulated;
-    void *dev; // differs between struct udev_device (internal devices) and DDCA_Display_Ref for external ones
+    void *dev; // plugin private: sysfs attributes fds for internal devices, DDCA_Display_Ref for external ones
     int max; // cached device max backlight value
+    int value; // shadow backlight value, served to clients; kept in sync by our own sets and by plugins
+    bool has_value; // whether shadow value has been loaded
+    bool loading; // an asynchronous read, started through get_async(), is in progress
     char obj_path[100];
     const char *sn;
     sd_bus_slot *slot;
@@ -49,6 +52,7 @@ typedef struct _bl_plugin {
     void (*receive)(void);
     int (*set)(bl_t *dev, int value);
     int (*get)(bl_t *dev);
+    int (*get_async)(bl_t *dev); // start reading dev without blocking, then call bl_loaded(); < 0 if unsupported
     void (*free_device)(bl_t *dev);
     void (*dtor)(void);
 } bl_plugin;
@@ -60,15 +64,17 @@ typedef struct _bl_plugin {
     static void receive(void); \
     static int set(bl_t *dev, int value); \
     static int get(bl_t *dev); \
+    static int get_async(bl_t *dev); \
     static void free_device(bl_t *dev); \
     static void dtor(void); \
     static void _ctor_ register_backlight_plugin(void) { \
-        static bl_plugin self = { name, load_env, load_devices, get_monitor, receive, set, get, free_device, dtor }; \
+        static bl_plugin self = { name, load_env, load_devices, get_monitor, receive, set, get, get_async, free_device, dtor }; \
         bl_register_new(&self); \
     }
 
 void bl_register_new(bl_plugin *plugin);
 int store_device(bl_t *bl, enum backlight_plugins plenum);
 void emit_signals(bl_t *bl, double pct);
+void bl_loaded(bl_t *bl, int value);
 
 extern map_t *bls;
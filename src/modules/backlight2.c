@@ -9,6 +9,11 @@ static void bl_dtor(void *data);
 
 /* Getters */
 map_ret_code get_backlight(void *userdata, const char *key, void *data);
+static void load_backlight(bl_t *bl);
+static void refresh_backlight(bl_t *bl);
+static bool is_loading(bl_t *bl);
+static void reply_refreshes(void);
+static void drop_refreshes(bl_t *bl);
 
 /* Setters */
 static int set_backlight_value(bl_t *bl, double *target_pct, double smooth_step);
@@ -25,10 +30,19 @@ int method_setbrightness(sd_bus_message *m, void *userdata, sd_bus_error *ret_er
 int method_getbrightness(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
 int method_raisebrightness(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
 int method_lowerbrightness(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static int method_forcerefresh(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+
+/* ForceRefresh call waiting for its devices to be read */
+typedef struct refresh_req {
+    sd_bus_message *m;
+    bl_t *bl; // NULL -> all devices
+    struct refresh_req *next;
+} refresh_req_t;
 
 map_t *bls;
 static int verse;
 static bl_plugin *plugins[BL_NUM];
+static refresh_req_t *refresh_reqs;
 
 static const char object_path[] = "/org/clightd/clightd/Backlight2";
 static const char bus_interface[] = "org.clightd.clightd.Backlight2.Server";
@@ -42,6 +56,7 @@ static const sd_bus_vtable main_vtable[] = {
     SD_BUS_VTABLE_START(0),
     SD_BUS_METHOD("Set", "d(du)", NULL, method_setbrightness, SD_BUS_VTABLE_UNPRIVILEGED),
     SD_BUS_METHOD("Get", NULL, "a(sd)", method_getbrightness, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("ForceRefresh", NULL, "a(sd)", method_forcerefresh, SD_BUS_VTABLE_UNPRIVILEGED),
     SD_BUS_METHOD("Raise", "d(du)", NULL, method_raisebrightness, SD_BUS_VTABLE_UNPRIVILEGED),
     SD_BUS_METHOD("Lower", "d(du)", NULL, method_lowerbrightness, SD_BUS_VTABLE_UNPRIVILEGED),
     SD_BUS_SIGNAL("Changed", "sd", 0),
@@ -51,6 +66,7 @@ static const sd_bus_vtable vtable[] = {
     SD_BUS_VTABLE_START(0),
     SD_BUS_METHOD("Set", "d(du)", NULL, method_setbrightness, SD_BUS_VTABLE_UNPRIVILEGED),
     SD_BUS_METHOD("Get", NULL, "d", method_getbrightness, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("ForceRefresh", NULL, "d", method_forcerefresh, SD_BUS_VTABLE_UNPRIVILEGED),
     SD_BUS_METHOD("Raise", "d(du)", NULL, method_raisebrightness, SD_BUS_VTABLE_UNPRIVILEGED),
     SD_BUS_METHOD("Lower", "d(du)", NULL, method_lowerbrightness, SD_BUS_VTABLE_UNPRIVILEGED),
     SD_BUS_PROPERTY("Max", "i", NULL, offsetof(bl_t, max), SD_BUS_VTABLE_PROPERTY_CONST),
@@ -138,6 +154,7 @@ static void receive(const msg_t *msg, const void *userdata) {
 }
 
 static void destroy(void) {
+    drop_refreshes(NULL);
     for (int i = 0; i < BL_NUM; i++) {
         if (plugins[i]) {
             plugins[i]->dtor();
@@ -156,6 +173,7 @@ static void stop_smooth(bl_t *bl) {
 
 static void bl_dtor(void *data) {
     bl_t *bl = (bl_t *)data;
+    drop_refreshes(bl);
     sd_bus_slot_unref(bl->slot);
     bl->plugin->free_device(bl);
     stop_smooth(bl);
@@ -208,21 +226,111 @@ void emit_signals(bl_t *bl, double pct) {
     sd_bus_emit_signal(bus, old_object_path, old_bus_interface, "Changed", "sd", bl->sn, pct);
     sd_bus_emit_signal(bus, bl->obj_path, bus_interface, "Changed", "d", pct);
 }
+
+/* Called by plugins once an asynchronous read ends; value < 0 on failure */
+void bl_loaded(bl_t *bl, int value) {
+    if (!bl->loading) {
+        return;
+    }
+    bl->loading = false;
+    if (value >= 0) {
+        bl->value = value;
+        bl->has_value = true;
+    }
+    reply_refreshes();
+}
 /** Backlight.h API **/
 
+/* Served from shadow value: devices are only read the first time, or when forced */
 map_ret_code get_backlight(void *userdata, const char *key, void *data) {
     bl_t *bl = (bl_t *)data;
     double *val = (double *)userdata;
-    *val = (double)bl->plugin->get(bl) / bl->max;
+    if (!bl->has_value) {
+        load_backlight(bl);
+    }
+    *val = (double)bl->value / bl->max;
     return MAP_OK;
 }
 
+/* On failure, keep any previous shadow value */
+static void load_backlight(bl_t *bl) {
+    const int value = bl->plugin->get(bl);
+    if (value >= 0) {
+        bl->value = value;
+        bl->has_value = true;
+    } else {
+        m_log("Failed to read backlight for %s: %s\n", bl->sn, strerror(-value));
+    }
+}
+
+/* Start reading a device, without blocking if plugin supports it */
+static void refresh_backlight(bl_t *bl) {
+    if (!bl->loading) {
+        bl->loading = true;
+        if (bl->plugin->get_async(bl) != 0) {
+            bl->loading = false;
+            load_backlight(bl);
+        }
+    }
+}
+
+static bool is_loading(bl_t *bl) {
+    if (bl) {
+        return bl->loading;
+    }
+    for (map_itr_t *itr = map_itr_new(bls); itr; itr = map_itr_next(itr)) {
+        bl_t *d = map_itr_get_data(itr);
+        if (d->loading) {
+            free(itr);
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Reply to any ForceRefresh call whose devices have all been read */
+static void reply_refreshes(void) {
+    refresh_req_t **req = &refresh_reqs;
+    while (*req) {
+        refresh_req_t *r = *req;
+        if (!is_loading(r->bl)) {
+            *req = r->next;
+            method_getbrightness(r->m, r->bl, NULL);
+            sd_bus_message_unref(r->m);
+            free(r);
+        } else {
+            req = &r->next;
+        }
+    }
+}
+
+/* Fail any ForceRefresh call waiting for a device being removed; all of them if bl is NULL */
+static void drop_refreshes(bl_t *bl) {
+    refresh_req_t **req = &refresh_reqs;
+    while (*req) {
+        refresh_req_t *r = *req;
+        if (!bl || r->bl == bl) {
+            *req = r->next;
+            sd_bus_reply_method_errno(r->m, ENODEV, NULL);
+            sd_bus_message_unref(r->m);
+            free(r);
+        } else {
+            req = &r->next;
+        }
+    }
+    if (bl) {
+        bl->loading = false;
+    }
+}
+
 /* Set a target_pct eventually computing smooth step */
 static int set_backlight_value(bl_t *bl, double *target_pct, double smooth_step) {
     const double next_pct = next_backlight_pct(bl, target_pct, smooth_step);
     const int value = (int)round(bl->max * next_pct);
     int ret = bl->plugin->set(bl, value);
     if (ret == 0) {
+        bl->value = value;
+        bl->has_value = true;
         /*
          * For external monitor:
          * Emit signals now as we will never receive them from udev monitor.
@@ -370,6 +478,34 @@ int method_getbrightness(sd_bus_message *m, void *userdata, sd_bus_error *ret_er
     return 0;
 }
 
+/*
+ * Devices are read concurrently, without blocking:
+ * reply is sent by reply_refreshes() once all of them have been read.
+ */
+static int method_forcerefresh(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    bl_t *d = (bl_t *)userdata;
+    if (d) {
+        refresh_backlight(d);
+    } else {
+        for (map_itr_t *itr = map_itr_new(bls); itr; itr = map_itr_next(itr)) {
+            refresh_backlight(map_itr_get_data(itr));
+        }
+    }
+    if (!is_loading(d)) {
+        return method_getbrightness(m, userdata, ret_error);
+    }
+    
+    refresh_req_t *req = malloc(sizeof(refresh_req_t));
+    if (!req) {
+        return -ENOMEM;
+    }
+    req->m = sd_bus_message_ref(m);
+    req->bl = d;
+    req->next = refresh_reqs;
+    refresh_reqs = req;
+    return 1;
+}
+
 int method_raisebrightness(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
     verse = 1;
     return method_setbrightness(m, userdata, ret_error);
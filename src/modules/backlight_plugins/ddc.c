@@ -4,6 +4,10 @@
 #include <ddcutil_macros.h>
 #include <udev.h>
 #include <glob.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include "gamma.h"
 #include "backlight.h"
 
@@ -13,12 +17,56 @@
 #define BL_VCP_ENV          "CLIGHTD_BL_VCP"
 #define BL_DDC_ENV          "CLIGHTD_BL_DDC_ENABLED"
 #define BL_EMULATED_ENV     "CLIGHTD_BL_EMULATED_ENABLED"
+#define BL_DDC_REFRESH_ENV  "CLIGHTD_BL_DDC_REFRESH"
 #define DRM_SUBSYSTEM       "drm"
+#define DDC_MIN_DELAY       50      // ms between two transactions, as required by DDC/CI spec
+#define DDC_MAX_DELAY       2000    // ms, upper bound for slow or failing displays
+#define DDC_HOTPLUG_DEBOUNCE 500    // ms of quiet after last drm hotplug event before redetecting displays
 
 static void add_new_external_display(const char *id, DDCA_Display_Info *dinfo, DDCA_Any_Vcp_Value *valrec);
 static void get_ddc_id(char *id, const DDCA_Display_Info *dinfo);
 static int get_emulated_id(char *id, int i2c_node);
 static void update_external_devices(void);
+static void start_worker(const char *id, DDCA_Display_Ref dref, int value, int written);
+static bool resume_worker(const char *id, DDCA_Display_Ref dref);
+static void park_workers(void);
+static void worker_dtor(void *data);
+static void add_ms(struct timespec *ts, const struct timespec *from, long ms);
+
+/*
+ * Each DDC display is driven by its own worker thread, that owns its display handle:
+ * main loop only posts brightness values to it,
+ * thus slow DDC transactions do not block it, nor other displays.
+ * Only latest posted value is written, and writes are paced by the display's own latency:
+ * display only receives values it can actually apply, and transitions do not lag behind.
+ * When idle, workers may also periodically read the display, to notice changes made eg: through its OSD.
+ * A stopped worker still writes its pending value before quitting, so that no posted value is lost.
+ * While displays are redetected, workers are parked, holding no display handle, 
+ * then resumed with their new display ref; pending values are written once resumed.
+ */
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    DDCA_Display_Ref dref;
+    DDCA_Vcp_Feature_Code br_code;
+    int target;                 // latest value to be written
+    bool pending;               // target still has to be written
+    int written;                // last value written to the display; -1 if unknown
+    int inflight;               // value being written right now, outside of lock; -1 if none
+    int value;                  // last value read from, or posted to, the display
+    int err;                    // last write error, reported by next set()
+    bool read_req;              // display has to be read
+    bool read_notify;           // read was requested by get_async(): notify it through refresh_fd
+    bool read_done;             // a read requested by get_async() ended
+    bool refreshed;             // a background refresh found a new value
+    double latency;             // ms, moving average of transactions latency
+    struct timespec next_tx;    // earliest time for next transaction
+    struct timespec next_refresh; // time for next background refresh
+    bool park;                  // main loop asked the worker to release its display handle
+    bool parked;                // worker holds no display handle, waiting to be resumed
+    bool quit;
+} ddc_worker_t;
 
 BACKLIGHT("DDC");
 
@@ -27,6 +75,11 @@ static DDCA_Vcp_Feature_Code br_code = 0x10;
 static bool ddc_backlight_enabled = true;
 static bool emulated_backlight_enabled = false;
 static uint64_t curr_cookie;
+static map_t *workers;  // id -> ddc_worker_t
+static int refresh_interval;    // ms between background refreshes; 0 -> disabled
+static int refresh_fd = -1;     // eventfd, signaled by workers when an asynchronous read ended or a background refresh found a new value
+static int hotplug_fd = -1;     // timerfd, debounces drm hotplug events
+static int epoll_fd = -1;       // drm monitor, hotplug_fd and refresh_fd
 
 static bool load_env(void) {
     if (getenv(BL_VCP_ENV)) {
@@ -41,6 +94,13 @@ static bool load_env(void) {
         emulated_backlight_enabled = strtol(getenv(BL_EMULATED_ENV), NULL, 10);
         printf("Overridden default emulated backlight mode: %d.\n", emulated_backlight_enabled);
     }
+    if (getenv(BL_DDC_REFRESH_ENV)) {
+        refresh_interval = strtol(getenv(BL_DDC_REFRESH_ENV), NULL, 10);
+        if (refresh_interval < 0) {
+            refresh_interval = 0;
+        }
+        printf("Overridden default DDC refresh interval: %d ms.\n", refresh_interval);
+    }
 #ifndef GAMMA_PRESENT
     printf("Gamma was not built in. Force-disable emulated backlight support.\n");
     emulated_backlight_enabled = false;
@@ -48,28 +108,104 @@ static bool load_env(void) {
     return ddc_backlight_enabled || emulated_backlight_enabled;
 }
 
+/* Probe result for a single display, filled by its own thread */
+typedef struct {
+    pthread_t thread;
+    DDCA_Display_Info *dinfo;
+    DDCA_Any_Vcp_Value *valrec;
+    bool known;
+    bool threaded;
+    bool opened;
+    int ret;
+} ddc_probe_t;
+
+static void *probe_display(void *data) {
+    ddc_probe_t *p = (ddc_probe_t *)data;
+    DDCA_Display_Handle dh = NULL;
+    if (ddca_open_display2(p->dinfo->dref, false, &dh) == 0) {
+        p->opened = true;
+        p->ret = ddca_get_any_vcp_value_using_explicit_type(dh, br_code, DDCA_NON_TABLE_VCP_VALUE, &p->valrec);
+        ddca_close_display(dh);
+    }
+    return NULL;
+}
+
+/*
+ * On redetection, displays we already know keep their
+ * max and shadow value: just refresh their cookie and dref,
+ * without talking to them again.
+ */
+static bool update_known_display(DDCA_Display_Info *dinfo) {
+    if (curr_cookie == 0) {
+        return false;
+    }
+    
+    char id[ID_MAX_LEN];
+    get_ddc_id(id, dinfo);
+    bl_t *d = map_get(bls, id);
+    if (!d || !d->is_ddc) {
+        if (dinfo->path.io_mode != DDCA_IO_I2C || get_emulated_id(id, dinfo->path.path.i2c_busno) != 0) {
+            return false;
+        }
+        d = map_get(bls, id);
+        if (!d || !d->is_emulated) {
+            return false;
+        }
+    }
+    d->cookie = curr_cookie;
+    d->dev = dinfo->dref;
+    if (d->is_ddc && !resume_worker(id, d->dev)) {
+        start_worker(id, d->dev, d->value, -1);
+    }
+    return true;
+}
+
 static void load_devices(void) {
     DDCA_Display_Info_List *dlist = NULL;
     ddca_get_display_info_list2(true, &dlist);
     if (!dlist) {
         return;
     }
+    
+    ddc_probe_t *probes = calloc(dlist->ct, sizeof(ddc_probe_t));
+    if (!probes) {
+        ddca_free_display_info_list(dlist);
+        return;
+    }
+    
+    /*
+     * Each display sits on its own bus:
+     * probe all new ones concurrently, so that we only pay for the slowest.
+     */
     for (int ndx = 0; ndx < dlist->ct; ndx++) {
-        DDCA_Display_Info *dinfo = &dlist->info[ndx];
-        DDCA_Display_Ref dref = dinfo->dref;
-        DDCA_Display_Handle dh = NULL;
-        if (ddca_open_display2(dref, false, &dh)) {
+        ddc_probe_t *p = &probes[ndx];
+        p->dinfo = &dlist->info[ndx];
+        p->known = update_known_display(p->dinfo);
+        if (!p->known) {
+            p->threaded = pthread_create(&p->thread, NULL, probe_display, p) == 0;
+            if (!p->threaded) {
+                probe_display(p);
+            }
+        }
+    }
+    
+    for (int ndx = 0; ndx < dlist->ct; ndx++) {
+        ddc_probe_t *p = &probes[ndx];
+        if (p->threaded) {
+            pthread_join(p->thread, NULL);
+        }
+        if (p->known || !p->opened) {
             continue;
         }
-        DDCA_Any_Vcp_Value *valrec;
+        
+        DDCA_Display_Info *dinfo = p->dinfo;
         char id[ID_MAX_LEN];
-        int ret = ddca_get_any_vcp_value_using_explicit_type(dh, br_code, DDCA_NON_TABLE_VCP_VALUE, &valrec);
-        if (ret == 0) {
+        if (p->ret == 0) {
             if (ddc_backlight_enabled) {
                 get_ddc_id(id, dinfo);
-                add_new_external_display(id, dinfo, valrec);
+                add_new_external_display(id, dinfo, p->valrec);
             }
-            ddca_free_any_vcp_value(valrec);
+            ddca_free_any_vcp_value(p->valrec);
         } else if (emulated_backlight_enabled && dinfo->path.io_mode == DDCA_IO_I2C) {
             if (get_emulated_id(id, dinfo->path.path.i2c_busno) == 0) {
                 // Skip internal laptop displays
@@ -78,19 +214,112 @@ static void load_devices(void) {
                 }
             }
         }
-        ddca_close_display(dh);
     }
+    free(probes);
     ddca_free_display_info_list(dlist);
 }
 
 static int get_monitor(void) {
-    return init_udev_monitor(DRM_SUBSYSTEM, &drm_mon);
+    int mon_fd = init_udev_monitor(DRM_SUBSYSTEM, &drm_mon);
+    if (mon_fd < 0) {
+        return mon_fd;
+    }
+    
+    /* Drm monitor is polled together with hotplug debounce timer and workers eventfd */
+    hotplug_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (hotplug_fd < 0 || epoll_fd < 0) {
+        fprintf(stderr, "Failed to setup DDC hotplug debounce: %m\n");
+        if (hotplug_fd >= 0) {
+            close(hotplug_fd);
+            hotplug_fd = -1;
+        }
+        if (epoll_fd >= 0) {
+            close(epoll_fd);
+            epoll_fd = -1;
+        }
+        return mon_fd;
+    }
+    struct epoll_event ev = { .events = EPOLLIN };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, mon_fd, &ev);
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, hotplug_fd, &ev);
+    
+    /* Workers notify asynchronous reads and background refreshes through an eventfd */
+    refresh_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (refresh_fd < 0) {
+        fprintf(stderr, "Failed to setup DDC workers notifications: %m\n");
+    } else {
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, refresh_fd, &ev);
+    }
+    return epoll_fd;
+}
+
+/*
+ * Only connectors plug/unplug is of interest:
+ * drm sends "change" uevents with HOTPLUG=1 for them,
+ * while eg: lease events carry LEASE=1.
+ */
+static bool is_hotplug_event(struct udev_device *dev) {
+    const char *action = udev_device_get_action(dev);
+    if (action && strcmp(action, "change") != 0) {
+        return true;
+    }
+    const char *hotplug = udev_device_get_property_value(dev, "HOTPLUG");
+    return hotplug && !strcmp(hotplug, "1");
+}
+
+/* 
+ * Update shadow value of any display whose value was changed by someone else,
+ * and hand asynchronous reads results back.
+ */
+static void sync_refreshed_values(void) {
+    for (map_itr_t *itr = map_itr_new(workers); itr; itr = map_itr_next(itr)) {
+        ddc_worker_t *w = map_itr_get_data(itr);
+        pthread_mutex_lock(&w->lock);
+        const bool refreshed = w->refreshed;
+        const bool read_done = w->read_done;
+        const int value = w->value;
+        w->refreshed = false;
+        w->read_done = false;
+        pthread_mutex_unlock(&w->lock);
+        
+        bl_t *bl = map_get(bls, map_itr_get_key(itr));
+        if (!bl) {
+            continue;
+        }
+        if (refreshed && (!bl->has_value || bl->value != value)) {
+            bl->value = value;
+            bl->has_value = true;
+            emit_signals(bl, (double)value / bl->max);
+        }
+        if (read_done) {
+            bl_loaded(bl, value);
+        }
+    }
 }
 
 static void receive(void) {
+    uint64_t t;
+    if (refresh_fd >= 0 && read(refresh_fd, &t, sizeof(t)) == sizeof(t)) {
+        sync_refreshed_values();
+    }
+    
+    /* Debounce expired: no more hotplug events since last one */
+    if (hotplug_fd >= 0 && read(hotplug_fd, &t, sizeof(t)) == sizeof(t)) {
+        update_external_devices();
+    }
+    
     struct udev_device *dev = udev_monitor_receive_device(drm_mon);
     if (dev) {
-        update_external_devices();
+        if (is_hotplug_event(dev)) {
+            /* Docking multiple monitors fires a burst of events: (re)arm the timer */
+            struct itimerspec timerspec = {{0}};
+            timerspec.it_value.tv_sec = DDC_HOTPLUG_DEBOUNCE / 1000;
+            timerspec.it_value.tv_nsec = (DDC_HOTPLUG_DEBOUNCE % 1000) * 1000000L;
+            if (hotplug_fd < 0 || timerfd_settime(hotplug_fd, 0, &timerspec, NULL) != 0) {
+                update_external_devices();
+            }
+        }
         udev_device_unref(dev);
     }
 }
@@ -99,50 +328,337 @@ static int set(bl_t *dev, int value) {
     if (dev->is_emulated) {
         return set_gamma_brightness(dev->sn, (double)value / dev->max);
     }
-    int ret = -1;
-    DDCA_Display_Handle dh = NULL;
-    if (!ddca_open_display2(dev->dev, false, &dh)) {
-        DDCA_Vcp_Feature_Code specific_br_code;
-        char specific_br_env[64];
-        snprintf(specific_br_env, sizeof(specific_br_env), BL_VCP_ENV"_%s", dev->sn);
-        if (getenv(specific_br_env)) {
-            specific_br_code = strtol(getenv(specific_br_env), NULL, 16);
-        } else {
-            specific_br_code = br_code;
-        }
-        int8_t new_sh = (value >> 8) & 0xff;
-        int8_t new_sl = value & 0xff;
-        ret = ddca_set_non_table_vcp_value(dh, specific_br_code, new_sh, new_sl);
-        ddca_close_display(dh);
+    ddc_worker_t *w = map_get(workers, dev->sn);
+    if (!w) {
+        return -ENODEV;
     }
+    
+    pthread_mutex_lock(&w->lock);
+    /* Report any failed write, so that eg: smoothing is stopped */
+    int ret = w->err;
+    w->err = 0;
+    if (ret == 0) {
+        /* 
+         * Any value not yet written is superseded.
+         * Compare against the value display will hold once current write (if any) ends.
+         */
+        const int last = w->inflight != -1 ? w->inflight : w->written;
+        w->target = value;
+        w->pending = value != last;
+        w->value = value;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
     return ret;
 }
 
+/* 
+ * Never wait for the display: return latest value read from, or posted to, it.
+ * Displays are actually read through get_async().
+ */
 static int get(bl_t *dev) {
     if (dev->is_emulated) {
         return get_gamma_brightness(dev->sn) * dev->max;
     }
-    int value = 0;
-    DDCA_Display_Handle dh = NULL;
-    if (ddca_open_display2(dev->dev, false, &dh) == 0) {
-        DDCA_Any_Vcp_Value *valrec = NULL;
-        if (!ddca_get_any_vcp_value_using_explicit_type(dh, br_code, DDCA_NON_TABLE_VCP_VALUE, &valrec)) {
-            value = VALREC_CUR_VAL(valrec);
-            ddca_free_any_vcp_value(valrec);
-        }
-        ddca_close_display(dh);
+    int value = -ENODEV;
+    ddc_worker_t *w = map_get(workers, dev->sn);
+    if (w) {
+        pthread_mutex_lock(&w->lock);
+        value = w->value;
+        pthread_mutex_unlock(&w->lock);
     }
     return value;
 }
 
+/* Ask the worker to read the display; result is handed back by sync_refreshed_values() */
+static int get_async(bl_t *dev) {
+    if (dev->is_emulated || refresh_fd < 0) {
+        return -ENOTSUP;
+    }
+    ddc_worker_t *w = map_get(workers, dev->sn);
+    if (!w) {
+        return -ENODEV;
+    }
+    pthread_mutex_lock(&w->lock);
+    w->read_req = true;
+    w->read_notify = true;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
 static void free_device(bl_t *dev) {
     if (dev->is_emulated) {
         clean_gamma_brightness(dev->sn);
+    } else {
+        map_remove(workers, dev->sn);
     }
 }
 
 static void dtor(void) {
     udev_monitor_unref(drm_mon);
+    map_free(workers);
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+    }
+    if (refresh_fd >= 0) {
+        close(refresh_fd);
+    }
+    if (hotplug_fd >= 0) {
+        close(hotplug_fd);
+    }
+}
+
+static inline double timespec_ms(const struct timespec *ts) {
+    return ts->tv_sec * 1000.0 + ts->tv_nsec / 1000000.0;
+}
+
+static void add_ms(struct timespec *ts, const struct timespec *from, long ms) {
+    ts->tv_sec = from->tv_sec + ms / 1000;
+    ts->tv_nsec = from->tv_nsec + (ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+/* Wake main loop up to sync workers results, see sync_refreshed_values() */
+static void notify_main_loop(void) {
+    if (refresh_fd >= 0) {
+        uint64_t one = 1;
+        if (write(refresh_fd, &one, sizeof(one)) != sizeof(one)) {
+            fprintf(stderr, "Failed to notify DDC worker event: %m\n");
+        }
+    }
+}
+
+/* Compute next transaction time given last transaction latency */
+static void update_pace(ddc_worker_t *w, const struct timespec *end, double latency, bool failed) {
+    if (w->latency == 0) {
+        w->latency = latency;
+    } else {
+        w->latency = (w->latency * 3 + latency) / 4;
+    }
+    
+    /* Give the display at least as much time as it took to answer; back off on failures */
+    double delay = w->latency > DDC_MIN_DELAY ? w->latency : DDC_MIN_DELAY;
+    if (failed) {
+        delay *= 2;
+    }
+    if (delay > DDC_MAX_DELAY) {
+        delay = DDC_MAX_DELAY;
+    }
+    
+    add_ms(&w->next_tx, end, delay);
+}
+
+/* Display handle is kept opened until the worker is stopped, or a transaction fails */
+static int write_value(ddc_worker_t *w, DDCA_Display_Handle *dh, int value) {
+    int ret = -ENODEV;
+    if (*dh || ddca_open_display2(w->dref, false, dh) == 0) {
+        ret = ddca_set_non_table_vcp_value(*dh, w->br_code, (value >> 8) & 0xff, value & 0xff);
+        if (ret != 0) {
+            ddca_close_display(*dh);
+            *dh = NULL;
+        }
+    }
+    return ret;
+}
+
+static int read_value(ddc_worker_t *w, DDCA_Display_Handle *dh) {
+    int value = -1;
+    if (*dh || ddca_open_display2(w->dref, false, dh) == 0) {
+        DDCA_Any_Vcp_Value *valrec = NULL;
+        if (!ddca_get_any_vcp_value_using_explicit_type(*dh, w->br_code, DDCA_NON_TABLE_VCP_VALUE, &valrec)) {
+            value = VALREC_CUR_VAL(valrec);
+            ddca_free_any_vcp_value(valrec);
+        } else {
+            ddca_close_display(*dh);
+            *dh = NULL;
+        }
+    }
+    return value;
+}
+
+static void *worker_loop(void *data) {
+    ddc_worker_t *w = (ddc_worker_t *)data;
+    DDCA_Display_Handle dh = NULL;
+    
+    pthread_mutex_lock(&w->lock);
+    /* Once asked to quit, only write pending value, if any, unless display ref is stale */
+    while (!w->quit || (w->pending && !w->park)) {
+        if (w->park) {
+            if (dh) {
+                pthread_mutex_unlock(&w->lock);
+                ddca_close_display(dh);
+                dh = NULL;
+                pthread_mutex_lock(&w->lock);
+            } else if (!w->parked) {
+                w->parked = true;
+                pthread_cond_broadcast(&w->cond);
+            } else {
+                pthread_cond_wait(&w->cond, &w->lock);
+            }
+            continue;
+        }
+        
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        const bool refresh = refresh_interval > 0 && timespec_ms(&start) >= timespec_ms(&w->next_refresh);
+        if (!w->pending && !w->read_req && !refresh) {
+            if (refresh_interval > 0) {
+                pthread_cond_timedwait(&w->cond, &w->lock, &w->next_refresh);
+            } else {
+                pthread_cond_wait(&w->cond, &w->lock);
+            }
+            continue;
+        }
+        
+        if (timespec_ms(&start) < timespec_ms(&w->next_tx)) {
+            /* Display is not ready yet; meanwhile, target may be superseded */
+            pthread_cond_timedwait(&w->cond, &w->lock, &w->next_tx);
+            continue;
+        }
+        
+        /* Writes have precedence over reads */
+        const bool is_write = w->pending;
+        const bool bg_refresh = !is_write && !w->read_req;
+        const int value = w->target;
+        w->pending = false;
+        w->inflight = is_write ? value : -1;
+        pthread_mutex_unlock(&w->lock);
+        
+        int ret = 0;
+        int cur_value = -1;
+        if (is_write) {
+            ret = write_value(w, &dh, value);
+        }
+        if (!is_write || ret != 0) {
+            /* Reload real value */
+            cur_value = read_value(w, &dh);
+        }
+        
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        
+        pthread_mutex_lock(&w->lock);
+        w->inflight = -1;
+        update_pace(w, &end, timespec_ms(&end) - timespec_ms(&start), ret != 0 || (!is_write && cur_value == -1));
+        add_ms(&w->next_refresh, &end, refresh_interval);
+        if (is_write && ret == 0) {
+            w->written = value;
+        } else {
+            if (ret != 0) {
+                w->err = ret;
+            }
+            w->written = cur_value;
+            /* Value read is only meaningful if no new value has been posted meanwhile */
+            if (cur_value != -1 && !w->pending) {
+                if (bg_refresh && cur_value != w->value) {
+                    w->refreshed = true;
+                    notify_main_loop();
+                }
+                w->value = cur_value;
+            }
+            if (w->read_req && w->read_notify) {
+                w->read_notify = false;
+                w->read_done = true;
+                notify_main_loop();
+            }
+            w->read_req = false;
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    
+    if (dh) {
+        ddca_close_display(dh);
+    }
+    return NULL;
+}
+
+static void start_worker(const char *id, DDCA_Display_Ref dref, int value, int written) {
+    if (!workers) {
+        workers = map_new(true, worker_dtor);
+    }
+    
+    ddc_worker_t *w = calloc(1, sizeof(ddc_worker_t));
+    if (!w) {
+        return;
+    }
+    w->dref = dref;
+    w->value = value;
+    w->written = written;
+    w->inflight = -1;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    add_ms(&w->next_refresh, &now, refresh_interval);
+    
+    char specific_br_env[64];
+    snprintf(specific_br_env, sizeof(specific_br_env), BL_VCP_ENV"_%s", id);
+    if (getenv(specific_br_env)) {
+        w->br_code = strtol(getenv(specific_br_env), NULL, 16);
+    } else {
+        w->br_code = br_code;
+    }
+    
+    /* Transactions are paced on monotonic clock */
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&w->thread, NULL, worker_loop, w) != 0) {
+        fprintf(stderr, "Failed to start worker for '%s'.\n", id);
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->cond);
+        free(w);
+        return;
+    }
+    map_put(workers, id, w);
+}
+
+/* Ask each worker to release its display handle, and wait for it, ie: for any in-flight transaction */
+static void park_workers(void) {
+    for (map_itr_t *itr = map_itr_new(workers); itr; itr = map_itr_next(itr)) {
+        ddc_worker_t *w = map_itr_get_data(itr);
+        pthread_mutex_lock(&w->lock);
+        w->park = true;
+        pthread_cond_broadcast(&w->cond);
+        while (!w->parked) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+/* Resume a parked worker with its redetected display ref; false if there is no such worker */
+static bool resume_worker(const char *id, DDCA_Display_Ref dref) {
+    ddc_worker_t *w = map_get(workers, id);
+    if (!w) {
+        return false;
+    }
+    pthread_mutex_lock(&w->lock);
+    w->dref = dref;
+    /* Display may have changed while unplugged (eg: it was power cycled): its value is unknown */
+    w->written = -1;
+    w->park = false;
+    w->parked = false;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    return true;
+}
+
+static void worker_dtor(void *data) {
+    ddc_worker_t *w = (ddc_worker_t *)data;
+    pthread_mutex_lock(&w->lock);
+    w->quit = true;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+    free(w);
 }
 
 static void add_new_external_display(const char *id, DDCA_Display_Info *dinfo, DDCA_Any_Vcp_Value *valrec) {
@@ -155,12 +671,17 @@ static void add_new_external_display(const char *id, DDCA_Display_Info *dinfo, D
             d->cookie = curr_cookie;
             if (valrec != NULL) {
                 d->max = VALREC_MAX_VAL(valrec);
+                d->value = VALREC_CUR_VAL(valrec);
+                d->has_value = true;
                 d->is_ddc = true;
             } else {
                 d->max = 100; // perc
                 d->is_emulated = true;
             }
             if (store_device(d, DDC) == 0) {
+                if (d->is_ddc) {
+                    start_worker(id, d->dev, VALREC_CUR_VAL(valrec), VALREC_CUR_VAL(valrec));
+                }
                 /* Not on first load */
                 if (d->cookie > 0) {
                     sd_bus_emit_object_added(bus, d->obj_path);
@@ -171,6 +692,13 @@ static void add_new_external_display(const char *id, DDCA_Display_Info *dinfo, D
         // Update cookie and dref
         d->cookie = curr_cookie;
         d->dev = dinfo->dref;
+        if (d->is_ddc && valrec) {
+            d->value = VALREC_CUR_VAL(valrec);
+            d->has_value = true;
+            /* Worker has been parked before redetecting displays */
+            map_remove(workers, id);
+            start_worker(id, d->dev, VALREC_CUR_VAL(valrec), VALREC_CUR_VAL(valrec));
+        }
     }
 }
 
@@ -215,14 +743,27 @@ static void update_external_devices(void) {
     /*
      * Algo: increment current cookie,
      * then rededect all displays.
-     * Then, store any new external monitor with new cookie,
-     * or update cookie and dref for still existent ones.
+     * Then, update cookie and dref for still existent ones
+     * and probe and store any new external monitor with new cookie.
      * Finally, remove any non-existent monitor 
      * (look for external monitors whose cookie is != of current cookie)
      */
     curr_cookie++;
+    /* 
+     * Display refs, and handles opened through them, are invalidated by redetection:
+     * workers release their handles, and keep their pending values and read requests,
+     * until they are resumed with their new display ref by load_devices().
+     */
+    park_workers();
     ddca_redetect_displays();
     load_devices();
+    for (map_itr_t *itr = map_itr_new(bls); itr; itr = map_itr_next(itr)) {
+        bl_t *d = map_itr_get_data(itr);
+        /* Reads requested to a replaced worker were lost: request them again, or fail them */
+        if (d->is_ddc && d->loading && get_async(d) != 0) {
+            bl_loaded(d, -1);
+        }
+    }
     for (map_itr_t *itr = map_itr_new(bls); itr; itr = map_itr_next(itr)) {
         bl_t *d = map_itr_get_data(itr);
         if (!d->is_internal && d->cookie != curr_cookie) {
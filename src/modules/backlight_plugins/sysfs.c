@@ -1,14 +1,30 @@
 #include "backlight.h"
 #include <udev.h>
+#include <sys/epoll.h>
 
 #define BL_SUBSYSTEM        "backlight"
 #define BL_SYSFS_ENV        "CLIGHTD_BL_SYSFS_ENABLED"
+#define BL_VAL_LEN          16
+
+/*
+ * Sysattrs are kept open for the whole device lifetime:
+ * writes and reads are a single pwrite/pread each,
+ * instead of an open/write/close roundtrip through libudev.
+ */
+typedef struct {
+    int br_fd;      // brightness sysattr
+    int actual_fd;  // actual_brightness sysattr, polled for POLLPRI
+} sysfs_dev_t;
 
 static int store_internal_device(struct udev_device *dev, void *userdata);
+static int read_value(int fd);
+static void sync_value(bl_t *bl);
 
 BACKLIGHT("Sysfs");
 
 static struct udev_monitor *bl_mon;
+static int mon_fd = -1;
+static int epoll_fd = -1;   // udev monitor and actual_brightness of each device
 
 static bool load_env(void) {
     bool bl_backlight_enabled = true;
@@ -24,10 +40,51 @@ static void load_devices(void) {
 }
 
 static int get_monitor(void) {
-    return init_udev_monitor(BL_SUBSYSTEM, &bl_mon);
+    mon_fd = init_udev_monitor(BL_SUBSYSTEM, &bl_mon);
+    if (mon_fd < 0) {
+        return mon_fd;
+    }
+    
+    /*
+     * Backlight class sysfs_notify()es actual_brightness on any change:
+     * poll it together with udev monitor to catch external changes
+     * without going through udev.
+     */
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        fprintf(stderr, "Failed to setup sysfs backlight notifications: %m\n");
+        return mon_fd;
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, mon_fd, &ev);
+    for (map_itr_t *itr = map_itr_new(bls); itr; itr = map_itr_next(itr)) {
+        bl_t *bl = map_itr_get_data(itr);
+        if (bl->is_internal) {
+            sysfs_dev_t *sdev = bl->dev;
+            ev = (struct epoll_event) { .events = EPOLLPRI, .data.ptr = bl };
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sdev->actual_fd, &ev);
+        }
+    }
+    return epoll_fd;
 }
 
 static void receive(void) {
+    if (epoll_fd >= 0) {
+        struct epoll_event events[8];
+        const int n = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(*events), 0);
+        bool from_udev = false;
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr) {
+                sync_value(events[i].data.ptr);
+            } else {
+                from_udev = true;
+            }
+        }
+        if (!from_udev) {
+            return;
+        }
+    }
+    
     /* From udev monitor, consume! */
     struct udev_device *dev = udev_monitor_receive_device(bl_mon);
     if (dev) {
@@ -37,17 +94,7 @@ static void receive(void) {
         if (action) {
             bl_t *bl = map_get(bls, id);
             if (!strcmp(action, UDEV_ACTION_CHANGE) && bl) {
-                // Load cached value
-                int old_bl_value = atoi(udev_device_get_sysattr_value(bl->dev, "brightness"));
-                /* Keep our device ref in sync! */
-                udev_device_unref(bl->dev);
-                bl->dev = udev_device_ref(dev);
-                
-                int val = atoi(udev_device_get_sysattr_value(dev, "brightness"));
-                if (val != old_bl_value) {
-                    const double pct = (double)val / bl->max;
-                    emit_signals(bl, pct);
-                }
+                sync_value(bl);
             } else if (!strcmp(action, UDEV_ACTION_ADD) && !bl) {
                 store_internal_device(dev, &bl);
             } else if (!strcmp(action, UDEV_ACTION_RM) && bl) {
@@ -60,21 +107,72 @@ static void receive(void) {
 }
 
 static int set(bl_t *dev, int value) {
-    char val[15] = {0};
-    snprintf(val, sizeof(val) - 1, "%d", value);
-    return udev_device_set_sysattr_value(dev->dev, "brightness", val);
+    sysfs_dev_t *sdev = dev->dev;
+    char val[BL_VAL_LEN];
+    const int len = snprintf(val, sizeof(val), "%d", value);
+    if (pwrite(sdev->br_fd, val, len, 0) != len) {
+        return -errno;
+    }
+    return 0;
 }
 
 static int get(bl_t *dev) {
-    return atoi(udev_device_get_sysattr_value(dev->dev, "brightness"));
+    sysfs_dev_t *sdev = dev->dev;
+    return read_value(sdev->br_fd);
+}
+
+static int get_async(bl_t *dev) {
+    /* Sysfs reads do not block */
+    return -ENOTSUP;
 }
 
 static void free_device(bl_t *dev) {
-    udev_device_unref(dev->dev);
+    sysfs_dev_t *sdev = dev->dev;
+    if (epoll_fd >= 0) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sdev->actual_fd, NULL);
+    }
+    close(sdev->actual_fd);
+    close(sdev->br_fd);
+    free(sdev);
 }
 
 static void dtor(void) {
     udev_monitor_unref(bl_mon);
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+    }
+}
+
+static int read_value(int fd) {
+    char val[BL_VAL_LEN];
+    const ssize_t len = pread(fd, val, sizeof(val) - 1, 0);
+    if (len <= 0) {
+        return -errno;
+    }
+    val[len] = '\0';
+    return strtol(val, NULL, 10);
+}
+
+/* Update shadow value and notify clients if brightness was changed by someone else */
+static void sync_value(bl_t *bl) {
+    sysfs_dev_t *sdev = bl->dev;
+    /* Reading actual_brightness from start rearms POLLPRI notification */
+    read_value(sdev->actual_fd);
+    
+    const int val = read_value(sdev->br_fd);
+    /* Compare against shadow value, that is updated by our own sets too */
+    if (val >= 0 && (!bl->has_value || val != bl->value)) {
+        bl->value = val;
+        bl->has_value = true;
+        const double pct = (double)val / bl->max;
+        emit_signals(bl, pct);
+    }
+}
+
+static int open_sysattr(struct udev_device *dev, const char *attr, int flags) {
+    char path[PATH_MAX + 1];
+    snprintf(path, sizeof(path), "%s/%s", udev_device_get_syspath(dev), attr);
+    return open(path, flags | O_CLOEXEC);
 }
 
 static int store_internal_device(struct udev_device *dev, void *userdata) {
@@ -82,18 +180,44 @@ static int store_internal_device(struct udev_device *dev, void *userdata) {
     const int max = atoi(udev_device_get_sysattr_value(dev, "max_brightness"));
     const char *id = udev_device_get_sysname(dev);
     bl_t *d = calloc(1, sizeof(bl_t));
-    if (d) {
+    sysfs_dev_t *sdev = calloc(1, sizeof(sysfs_dev_t));
+    if (d && sdev) {
+        sdev->br_fd = open_sysattr(dev, "brightness", O_RDWR);
+        sdev->actual_fd = open_sysattr(dev, "actual_brightness", O_RDONLY);
+        if (sdev->br_fd < 0 || sdev->actual_fd < 0) {
+            ret = -errno;
+            fprintf(stderr, "Failed to open %s sysattrs: %m\n", id);
+            if (sdev->br_fd >= 0) {
+                close(sdev->br_fd);
+            }
+            if (sdev->actual_fd >= 0) {
+                close(sdev->actual_fd);
+            }
+            goto err;
+        }
+        
         d->is_internal = true;
-        d->dev = udev_device_ref(dev);
+        d->dev = sdev;
         d->max = max;
         d->sn = strdup(id);
-        // Unused. But receive() callback expects brightness value to be cached
-        udev_device_get_sysattr_value(dev, "brightness");
+        d->value = read_value(sdev->br_fd);
+        d->has_value = d->value >= 0;
         ret = store_device(d, SYSFS);
-        if (ret == 0 && userdata != NULL) {
-            /* Not on first load (userdata != NULL only true when called by receive()) */
-            sd_bus_emit_object_added(bus, d->obj_path);
+        if (ret == 0) {
+            if (epoll_fd >= 0) {
+                struct epoll_event ev = { .events = EPOLLPRI, .data.ptr = d };
+                epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sdev->actual_fd, &ev);
+            }
+            if (userdata != NULL) {
+                /* Not on first load (userdata != NULL only true when called by receive()) */
+                sd_bus_emit_object_added(bus, d->obj_path);
+            }
         }
+        return ret;
     }
+    
+err:
+    free(sdev);
+    free(d);
     return ret;
 }
@@ -1,8 +1,79 @@
 #include <sensor.h>
 #include <polkit.h>
-#include "bus_utils.h"
+#include <udev.h>
+#include <module/map.h>
+#include <math.h>
 
-#define SENSOR_MAX_CAPTURES    20
+#define SENSOR_MAX_CAPTURES         20
+#define SENSOR_MIN_STREAM_INTERVAL  50 // ms
+#define SENSOR_TRIM_PCT             10 // % of samples dropped on each side for trimmed mean
+#define SENSOR_STREAM_DELTA         0.01 // default max change between samples for a stream to back off
+#define SENSOR_STREAM_THRESHOLD     0.05 // default min change between samples for a stream to snap back
+
+/* Kind of timer fd registered by sensor module, see receive() */
+typedef enum { STREAM_TIMER, CAPTURE_TIMER } sensor_timer_t;
+
+typedef struct {
+    sensor_timer_t type;        // must be first
+    unsigned int id;
+    unsigned int interval;      // ms
+    unsigned int cur_interval;  // ms; differs from interval in adaptive mode
+    unsigned int max_interval;  // ms; adaptive mode is enabled when > interval
+    double delta;               // adaptive mode: samples within delta double cur_interval
+    double threshold;           // adaptive mode: samples changing more than threshold reset cur_interval
+    double last_pct;
+    bool has_last;
+    int fd;                     // stream timer fd
+    sensor_t *sensor;           // requested sensor; NULL -> first available one
+    char *interface;
+    char *settings;
+    char *sender;               // BusName who started the stream
+    char path[100];             // stream object path
+    sd_bus_slot *slot;          // vtable's slot
+    sd_bus_slot *track_slot;    // NameOwnerChanged match slot
+} sensor_stream_t;
+
+typedef struct {
+    sensor_timer_t type;        // must be first
+    char id[16];
+    int fd;                     // capture timer fd
+    sd_bus_message *m;          // Capture method call, replied once all samples are taken
+    sensor_t *sensor;           // sensor picked for first sample
+    char *interface;
+    char *settings;
+    char node[PATH_MAX + 1];    // node of last sampled device
+    double *pct;
+    uint64_t *ts;               // monotonic timestamp (us) of each sample
+    bool stats;                 // CaptureStats call: reply with aggregate stats
+    struct _fusion *fusion;     // CaptureFusion call this capture belongs to, if any
+    int entry;                  // index of this capture in fusion entries
+    int num_captures;
+    int num_samples;            // samples taken so far
+    int ctr;                    // samples successfully captured
+} sensor_capture_t;
+
+typedef struct {
+    sensor_t *sensor;
+    double weight;
+    char node[PATH_MAX + 1];
+    double pct[SENSOR_MAX_CAPTURES];
+    int ctr;                    // samples successfully captured
+} sensor_fusion_entry_t;
+
+typedef struct _fusion {
+    char id[16];
+    sd_bus_message *m;          // CaptureFusion method call, replied once all entries are done
+    int num_entries;
+    int pending;                // entries still capturing
+    sensor_fusion_entry_t entries[SENSOR_NUM];
+} sensor_fusion_t;
+
+typedef struct {
+    double median;
+    double trimmed_mean;
+    double variance;
+    double filtered_mean;       // mean of samples within 1.5 IQR from quartiles
+} sensor_stats_t;
 
 static bool is_sensor_available(sensor_t *sensor, const char *interface, 
                                 void **device);
@@ -10,15 +81,59 @@ static void *find_available_sensor(sensor_t *sensor, const char *interface, void
 static void sensor_receive_device(const sensor_t *sensor, void **dev);
 static int method_issensoravailable(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
 static int method_capturesensor(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static int method_capturestats(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static int capture_sensor(sd_bus_message *m, void *userdata, sd_bus_error *ret_error, bool stats);
+static int method_capturefusion(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static sensor_capture_t *start_capture(sensor_t *sensor, const char *interface, const char *settings, 
+                                       const int num_captures, const int interval);
+static void fusion_entry_done(sensor_fusion_t *fusion, int entry, const char *node, const double *pct, int ctr);
+static void fusion_release(sensor_fusion_t *fusion);
+static void fusion_dtor(void *data);
+static int capture_once(sensor_t *sensor, void *dev, double *pct, uint64_t *ts, const int num_captures, const char *settings);
+static int get_capture_interval(sensor_t *sensor, void *dev, const char *settings);
+static int reply_capture(sd_bus_message *m, const char *node, double *pct, uint64_t *ts, int num, bool stats);
+static void compute_stats(const double *pct, int num, sensor_stats_t *stats);
+static void capture_sample(sensor_capture_t *cap, sensor_t *sensor, void *dev);
+static void capture_dtor(void *data);
+static void stream_sample(sensor_stream_t *st);
+static void stream_dtor(void *data);
+static int on_name_owner_changed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static int method_startstream(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static int method_stopstream(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static int set_stream_adaptive(sd_bus *b, const char *path, const char *interface, const char *property, 
+                               sd_bus_message *value, void *userdata, sd_bus_error *error);
+static void stream_adapt(sensor_stream_t *st, double pct);
+static void set_stream_timer(sensor_stream_t *st, unsigned int interval, bool now);
 
 static sensor_t *sensors[SENSOR_NUM];
+static map_t *streams;
+static map_t *captures;
+static map_t *fusions;
+static unsigned int stream_ctr;
+static unsigned int capture_ctr;
 static const char object_path[] = "/org/clightd/clightd/Sensor";
 static const char bus_interface[] = "org.clightd.clightd.Sensor";
 static const sd_bus_vtable vtable[] = {
     SD_BUS_VTABLE_START(0),
     SD_BUS_METHOD("Capture", "sis", "sad", method_capturesensor, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("CaptureStats", "sis", "sdddda(td)", method_capturestats, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("CaptureFusion", "a(sssd)i", "da(ssad)", method_capturefusion, SD_BUS_VTABLE_UNPRIVILEGED),
     SD_BUS_METHOD("IsAvailable", "s", "sb", method_issensoravailable, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("StartStream", "sus", "o", method_startstream, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("StopStream", "o", NULL, method_stopstream, SD_BUS_VTABLE_UNPRIVILEGED),
     SD_BUS_SIGNAL("Changed", "ss", 0),
+    SD_BUS_SIGNAL("LightChanged", "sd", 0),
+    SD_BUS_VTABLE_END
+};
+static const char stream_interface[] = "org.clightd.clightd.Sensor.Stream";
+static const sd_bus_vtable vtable_stream[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_PROPERTY("Interval", "u", NULL, offsetof(sensor_stream_t, interval), SD_BUS_VTABLE_PROPERTY_CONST),
+    SD_BUS_PROPERTY("CurrentInterval", "u", NULL, offsetof(sensor_stream_t, cur_interval), 0),
+    SD_BUS_WRITABLE_PROPERTY("MaxInterval", "u", NULL, set_stream_adaptive, offsetof(sensor_stream_t, max_interval), SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_WRITABLE_PROPERTY("Delta", "d", NULL, set_stream_adaptive, offsetof(sensor_stream_t, delta), SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_WRITABLE_PROPERTY("Threshold", "d", NULL, set_stream_adaptive, offsetof(sensor_stream_t, threshold), SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_SIGNAL("Sample", "sd", 0),
     SD_BUS_VTABLE_END
 };
 
@@ -37,6 +152,9 @@ static bool evaluate(void) {
 }
 
 static void init(void) {
+    streams = map_new(true, stream_dtor);
+    captures = map_new(true, capture_dtor);
+    fusions = map_new(true, fusion_dtor);
     int r = sd_bus_add_object_vtable(bus,
                                     NULL,
                                     object_path,
@@ -68,6 +186,27 @@ static void init(void) {
 
 static void receive(const msg_t *msg, const void *userdata) {
     if (!msg->is_pubsub) {
+        bool from_monitor = false;
+        for (int i = 0; i < SENSOR_NUM && !from_monitor; i++) {
+            from_monitor = sensors[i] && sensors[i] == msg->fd_msg->userptr;
+        }
+        if (!from_monitor) {
+            uint64_t t;
+            read(msg->fd_msg->fd, &t, sizeof(uint64_t));
+            switch (*(sensor_timer_t *)msg->fd_msg->userptr) {
+                case STREAM_TIMER:
+                    stream_sample((sensor_stream_t *)msg->fd_msg->userptr);
+                    break;
+                case CAPTURE_TIMER:
+                    capture_sample((sensor_capture_t *)msg->fd_msg->userptr, NULL, NULL);
+                    break;
+            }
+            return;
+        }
+        
+        /* A sensor device was added or removed: cached udev lookups may be stale */
+        udev_cache_invalidate();
+        
         sensor_t *sensor = (sensor_t *)msg->fd_msg->userptr;
         void *dev = NULL;
         sensor_receive_device(sensor, &dev);
@@ -88,6 +227,9 @@ static void receive(const msg_t *msg, const void *userdata) {
 }
 
 static void destroy(void) {
+    map_free(streams);
+    map_free(captures);
+    map_free(fusions);
     for (int i = 0; i < SENSOR_NUM; i++) {
         if (sensors[i]) {
             sensors[i]->destroy_monitor();
@@ -117,6 +259,17 @@ void sensor_register_new(sensor_t *sensor) {
     }
 }
 
+void sensor_emit_light_changed(const char *name, const char *node, double pct) {
+    for (int i = 0; i < SENSOR_NUM; i++) {
+        if (sensors[i] && !strcmp(sensors[i]->name, name)) {
+            sd_bus_emit_signal(bus, sensors[i]->obj_path, bus_interface, "LightChanged", "sd", node, pct);
+            /* LightChanged is emitted on Sensor main object too */
+            sd_bus_emit_signal(bus, object_path, bus_interface, "LightChanged", "sd", node, pct);
+            break;
+        }
+    }
+}
+
 static void sensor_receive_device(const sensor_t *sensor, void **dev) {
     *dev = NULL;
     if (sensor) {
@@ -186,10 +339,22 @@ static int method_issensoravailable(sd_bus_message *m, void *userdata, sd_bus_er
 }
 
 static int method_capturesensor(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    return capture_sensor(m, userdata, ret_error, false);
+}
+
+/*
+ * Same as Capture, but replies with samples median, trimmed mean, variance 
+ * and IQR outlier-rejected mean, followed by each sample with its timestamp.
+ */
+static int method_capturestats(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    return capture_sensor(m, userdata, ret_error, true);
+}
+
+static int capture_sensor(sd_bus_message *m, void *userdata, sd_bus_error *ret_error, bool stats) {
     ASSERT_AUTH();
         
     const char *interface = NULL;
-    char *settings = NULL;
+    const char *settings = NULL;
     const int num_captures;
     int r = sd_bus_message_read(m, "sis", &interface, &num_captures, &settings);
     if (r < 0) {
@@ -202,46 +367,627 @@ static int method_capturesensor(sd_bus_message *m, void *userdata, sd_bus_error
         return -EINVAL;
     }
     
-    bus_sender_fill_creds(m); // used by PW plugin
-    
     void *dev = NULL;
-    sensor_t *sensor = NULL;
-    double *pct = calloc(num_captures, sizeof(double));
-    if (pct) {
-        sensor = find_available_sensor(userdata, interface, &dev);
+    sensor_t *sensor = find_available_sensor(userdata, interface, &dev);
+    if (!sensor) {
+        /* No sensors available */
+        sd_bus_error_set_errno(ret_error, ENODEV);
+        return -ENODEV;
+    }
     
-        // default value
-        r = -ENODEV;
-        if (sensor) {
-            /* Bus Interface required sensor-specific method */
-            r = sensor->capture(dev, pct, num_captures, settings);
+    const int interval = get_capture_interval(sensor, dev, settings);
+    if (interval > 0 && num_captures > 1) {
+        /*
+         * Do not block the main loop sleeping between samples:
+         * take first sample right now, then one each interval ms
+         * through a timerfd; reply is sent once all samples are taken.
+         */
+        sensor_capture_t *cap = start_capture(sensor, interface, settings, num_captures, interval);
+        if (!cap) {
+            sensor->destroy_dev(dev);
+            sd_bus_error_set_errno(ret_error, ENOMEM);
+            return -ENOMEM;
         }
+        cap->m = sd_bus_message_ref(m);
+        cap->stats = stats;
+        capture_sample(cap, sensor, dev);
+        sensor->destroy_dev(dev);
+        return 1; // reply is sent later
+    }
+    
+    double *pct = calloc(num_captures, sizeof(double));
+    uint64_t *ts = calloc(num_captures, sizeof(uint64_t));
+    if (pct && ts) {
+        /* Bus Interface required sensor-specific method */
+        r = capture_once(sensor, dev, pct, ts, num_captures, settings);
     } else {
         r = -ENOMEM;
     }
     
-    /* No sensors available */
     if (r < 0) {
         sd_bus_error_set_errno(ret_error, -r);
     } else if (r == 0) {
         sd_bus_error_set_errno(ret_error, EIO);
     } else {
-        /* Reply with array response */
-        sd_bus_message *reply = NULL;
-        sd_bus_message_new_method_return(m, &reply);
-        
         const char *node = NULL;
         sensor->fetch_props_dev(dev, &node, NULL);
-        sd_bus_message_append(reply, "s", node);
-        sd_bus_message_append_array(reply, 'd', pct, r * sizeof(double));
-        r = sd_bus_send(NULL, reply, NULL);
+        r = reply_capture(m, node, pct, ts, r, stats);
+    }
+    
+    /* Properly free dev */
+    sensor->destroy_dev(dev);
+    free(pct);
+    free(ts);
+    return r;
+}
+
+/* 
+ * Create an interval-paced capture, with its timer already armed;
+ * caller is expected to take first sample right away through capture_sample().
+ */
+static sensor_capture_t *start_capture(sensor_t *sensor, const char *interface, const char *settings, 
+                                       const int num_captures, const int interval) {
+    sensor_capture_t *cap = calloc(1, sizeof(sensor_capture_t));
+    double *pct = calloc(num_captures, sizeof(double));
+    uint64_t *ts = calloc(num_captures, sizeof(uint64_t));
+    if (!cap || !pct || !ts) {
+        free(cap);
+        free(pct);
+        free(ts);
+        return NULL;
+    }
+    cap->type = CAPTURE_TIMER;
+    snprintf(cap->id, sizeof(cap->id), "%u", capture_ctr++);
+    cap->sensor = sensor;
+    cap->interface = strdup(interface);
+    cap->settings = strdup(settings);
+    cap->pct = pct;
+    cap->ts = ts;
+    cap->num_captures = num_captures;
+    cap->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    m_register_fd(cap->fd, true, cap);
+    map_put(captures, cap->id, cap);
+    
+    struct itimerspec timerValue = {{0}};
+    timerValue.it_value.tv_sec = interval / 1000;
+    timerValue.it_value.tv_nsec = 1000 * 1000 * (interval % 1000); // ms
+    timerValue.it_interval = timerValue.it_value;
+    timerfd_settime(cap->fd, 0, &timerValue, NULL);
+    return cap;
+}
+
+/* capture() may tokenize settings in place: give it a copy */
+static int capture_once(sensor_t *sensor, void *dev, double *pct, uint64_t *ts, const int num_captures, const char *settings) {
+    char *s = strdup(settings);
+    if (!s) {
+        return -ENOMEM;
+    }
+    int r = sensor->capture(dev, pct, ts, num_captures, s);
+    free(s);
+    return r;
+}
+
+static int get_capture_interval(sensor_t *sensor, void *dev, const char *settings) {
+    char *s = strdup(settings);
+    if (!s) {
+        return 0;
+    }
+    int interval = sensor->capture_interval(dev, s);
+    free(s);
+    return interval;
+}
+
+static int reply_capture(sd_bus_message *m, const char *node, double *pct, uint64_t *ts, int num, bool stats) {
+    sd_bus_message *reply = NULL;
+    sd_bus_message_new_method_return(m, &reply);
+    sd_bus_message_append(reply, "s", node);
+    if (!stats) {
+        /* Reply with array response */
+        sd_bus_message_append_array(reply, 'd', pct, num * sizeof(double));
+    } else {
+        sensor_stats_t st;
+        compute_stats(pct, num, &st);
+        sd_bus_message_append(reply, "dddd", st.median, st.trimmed_mean, st.variance, st.filtered_mean);
+        sd_bus_message_open_container(reply, SD_BUS_TYPE_ARRAY, "(td)");
+        for (int i = 0; i < num; i++) {
+            sd_bus_message_append(reply, "(td)", ts[i], pct[i]);
+        }
+        sd_bus_message_close_container(reply);
+    }
+    int r = sd_bus_send(NULL, reply, NULL);
+    sd_bus_message_unref(reply);
+    return r;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    const double x = *(const double *)a;
+    const double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Linearly interpolated q-quantile of sorted samples */
+static double quantile(const double *sorted, int num, double q) {
+    const double pos = q * (num - 1);
+    const int i = pos;
+    if (i + 1 >= num) {
+        return sorted[num - 1];
+    }
+    return sorted[i] + (pos - i) * (sorted[i + 1] - sorted[i]);
+}
+
+static void compute_stats(const double *pct, int num, sensor_stats_t *stats) {
+    double sorted[SENSOR_MAX_CAPTURES];
+    memcpy(sorted, pct, num * sizeof(double));
+    qsort(sorted, num, sizeof(double), cmp_double);
+    
+    stats->median = quantile(sorted, num, 0.5);
+    
+    double mean = 0.0;
+    for (int i = 0; i < num; i++) {
+        mean += sorted[i];
+    }
+    mean /= num;
+    
+    stats->variance = 0.0;
+    for (int i = 0; i < num; i++) {
+        stats->variance += (sorted[i] - mean) * (sorted[i] - mean);
+    }
+    stats->variance /= num;
+    
+    const int trim = num * SENSOR_TRIM_PCT / 100;
+    double sum = 0.0;
+    for (int i = trim; i < num - trim; i++) {
+        sum += sorted[i];
+    }
+    stats->trimmed_mean = sum / (num - 2 * trim);
+    
+    /* Trim outliers via interquartile range, like camera frame histogram does */
+    const double q1 = quantile(sorted, num, 0.25);
+    const double q3 = quantile(sorted, num, 0.75);
+    const double iqr = (q3 - q1) * 1.5;
+    int ctr = 0;
+    sum = 0.0;
+    for (int i = 0; i < num; i++) {
+        if (sorted[i] >= q1 - iqr && sorted[i] <= q3 + iqr) {
+            sum += sorted[i];
+            ctr++;
+        }
+    }
+    stats->filtered_mean = sum / ctr; // median is always within range, thus ctr > 0
+}
+
+/* 
+ * Take a single sample for an interval-paced capture.
+ * When called by capture timer (sensor == NULL), device is fetched again,
+ * as devices are not held between main loop iterations.
+ * Once all samples are taken, method call is replied and capture removed.
+ */
+static void capture_sample(sensor_capture_t *cap, sensor_t *sensor, void *dev) {
+    const bool owns_dev = sensor == NULL;
+    if (owns_dev) {
+        sensor = find_available_sensor(cap->sensor, cap->interface, &dev);
+    }
+    if (sensor) {
+        if (capture_once(sensor, dev, &cap->pct[cap->ctr], &cap->ts[cap->ctr], 1, cap->settings) == 1) {
+            const char *node = NULL;
+            sensor->fetch_props_dev(dev, &node, NULL);
+            snprintf(cap->node, sizeof(cap->node), "%s", node);
+            cap->ctr++;
+        }
+        if (owns_dev) {
+            sensor->destroy_dev(dev);
+        }
+    }
+    
+    if (++cap->num_samples == cap->num_captures) {
+        if (cap->fusion) {
+            fusion_entry_done(cap->fusion, cap->entry, cap->node, cap->pct, cap->ctr);
+        } else if (cap->ctr > 0) {
+            reply_capture(cap->m, cap->node, cap->pct, cap->ts, cap->ctr, cap->stats);
+        } else {
+            sd_bus_reply_method_errno(cap->m, sensor ? EIO : ENODEV, NULL);
+        }
+        char id[sizeof(cap->id)];
+        strcpy(id, cap->id);
+        map_remove(captures, id);
+    }
+}
+
+/*
+ * Sample several sensors within a single call: interval-paced sensors
+ * are sampled concurrently, each on its own capture timer, while the others
+ * capture right away; reply carries the weighted mean of each sensor's samples mean
+ * (plain mean if all sampled sensors have a 0 weight), and each sensor's name, node and samples.
+ * Note that device-paced sensors (eg: Camera) still capture synchronously on the main loop:
+ * capture timers cannot fire meanwhile, thus interval-paced samples are delayed
+ * until device-paced captures are done.
+ */
+static int method_capturefusion(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    ASSERT_AUTH();
+    
+    int r = sd_bus_message_enter_container(m, SD_BUS_TYPE_ARRAY, "(sssd)");
+    if (r < 0) {
+        m_log("Failed to parse parameters: %s\n", strerror(-r));
+        return r;
+    }
+    
+    sensor_fusion_t *fusion = calloc(1, sizeof(sensor_fusion_t));
+    if (!fusion) {
+        sd_bus_error_set_errno(ret_error, ENOMEM);
+        return -ENOMEM;
+    }
+    
+    /* Store requests; interface and settings point into m, that outlives this function */
+    const char *interfaces[SENSOR_NUM] = {0};
+    const char *settings[SENSOR_NUM] = {0};
+    const char *name = NULL;
+    const char *interface = NULL;
+    const char *setting = NULL;
+    double weight;
+    while ((r = sd_bus_message_read(m, "(sssd)", &name, &interface, &setting, &weight)) > 0) {
+        sensor_t *sensor = NULL;
+        for (int i = 0; i < SENSOR_NUM && !sensor; i++) {
+            if (sensors[i] && !strcasecmp(sensors[i]->name, name)) {
+                sensor = sensors[i];
+            }
+        }
+        bool dup = false;
+        for (int i = 0; i < fusion->num_entries && !dup; i++) {
+            dup = fusion->entries[i].sensor == sensor;
+        }
+        if (!sensor || dup || weight < 0) {
+            free(fusion);
+            sd_bus_error_setf(ret_error, SD_BUS_ERROR_INVALID_ARGS, "Wrong or duplicated sensor '%s' or negative weight.", name);
+            return -EINVAL;
+        }
+        sensor_fusion_entry_t *e = &fusion->entries[fusion->num_entries];
+        e->sensor = sensor;
+        e->weight = weight;
+        interfaces[fusion->num_entries] = interface;
+        settings[fusion->num_entries] = setting;
+        fusion->num_entries++;
+    }
+    
+    int num_captures = 0;
+    if (r == 0) {
+        sd_bus_message_exit_container(m);
+        r = sd_bus_message_read(m, "i", &num_captures);
+    }
+    if (r < 0) {
+        free(fusion);
+        m_log("Failed to parse parameters: %s\n", strerror(-r));
+        return r;
+    }
+    
+    if (fusion->num_entries == 0 || num_captures <= 0 || num_captures > SENSOR_MAX_CAPTURES) {
+        free(fusion);
+        sd_bus_error_set_const(ret_error, SD_BUS_ERROR_INVALID_ARGS, "At least a sensor, and between 1 and 20 captures, are needed.");
+        return -EINVAL;
+    }
+    
+    snprintf(fusion->id, sizeof(fusion->id), "%u", capture_ctr++);
+    fusion->m = sd_bus_message_ref(m);
+    fusion->pending = fusion->num_entries + 1; // keep fusion alive until all entries are started
+    map_put(fusions, fusion->id, fusion);
+    
+    /* Start interval-paced captures first, so that they run while other sensors capture */
+    void *devs[SENSOR_NUM] = {0};
+    for (int i = 0; i < fusion->num_entries; i++) {
+        sensor_fusion_entry_t *e = &fusion->entries[i];
+        if (!find_available_sensor(e->sensor, interfaces[i], &devs[i])) {
+            fusion_entry_done(fusion, i, "", NULL, 0);
+            continue;
+        }
+        const int interval = get_capture_interval(e->sensor, devs[i], settings[i]);
+        if (interval > 0 && num_captures > 1) {
+            sensor_capture_t *cap = start_capture(e->sensor, interfaces[i], settings[i], num_captures, interval);
+            if (cap) {
+                cap->fusion = fusion;
+                cap->entry = i;
+                capture_sample(cap, e->sensor, devs[i]);
+                e->sensor->destroy_dev(devs[i]);
+                devs[i] = NULL;
+            }
+        }
+    }
+    
+    /* Then capture from any other sensor */
+    for (int i = 0; i < fusion->num_entries; i++) {
+        if (devs[i]) {
+            sensor_fusion_entry_t *e = &fusion->entries[i];
+            double pct[SENSOR_MAX_CAPTURES];
+            uint64_t ts[SENSOR_MAX_CAPTURES];
+            const char *node = NULL;
+            int ctr = capture_once(e->sensor, devs[i], pct, ts, num_captures, settings[i]);
+            e->sensor->fetch_props_dev(devs[i], &node, NULL);
+            fusion_entry_done(fusion, i, node, pct, ctr);
+            e->sensor->destroy_dev(devs[i]);
+        }
+    }
+    
+    fusion_release(fusion);
+    return 1; // reply is sent once all entries are done
+}
+
+static void fusion_entry_done(sensor_fusion_t *fusion, int entry, const char *node, const double *pct, int ctr) {
+    sensor_fusion_entry_t *e = &fusion->entries[entry];
+    snprintf(e->node, sizeof(e->node), "%s", node);
+    e->ctr = ctr > 0 ? ctr : 0;
+    if (e->ctr > 0) {
+        memcpy(e->pct, pct, e->ctr * sizeof(double));
+    }
+    fusion_release(fusion);
+}
+
+/* Once all entries are done, reply with weighted mean and remove fusion */
+static void fusion_release(sensor_fusion_t *fusion) {
+    if (--fusion->pending > 0) {
+        return;
+    }
+    
+    sensor_fusion_entry_t *e;
+    double combined = 0.0;
+    double weights = 0.0;
+    double unweighted = 0.0;
+    int sampled = 0;
+    for (int i = 0; i < fusion->num_entries; i++) {
+        e = &fusion->entries[i];
+        if (e->ctr > 0) {
+            double mean = 0.0;
+            for (int j = 0; j < e->ctr; j++) {
+                mean += e->pct[j];
+            }
+            mean /= e->ctr;
+            combined += e->weight * mean;
+            weights += e->weight;
+            unweighted += mean;
+            sampled++;
+        }
+    }
+    
+    if (sampled > 0) {
+        sd_bus_message *reply = NULL;
+        sd_bus_message_new_method_return(fusion->m, &reply);
+        /* Only 0-weighted sensors were sampled: fallback to their plain mean */
+        sd_bus_message_append(reply, "d", weights > 0.0 ? combined / weights : unweighted / sampled);
+        sd_bus_message_open_container(reply, SD_BUS_TYPE_ARRAY, "(ssad)");
+        for (int i = 0; i < fusion->num_entries; i++) {
+            e = &fusion->entries[i];
+            sd_bus_message_open_container(reply, SD_BUS_TYPE_STRUCT, "ssad");
+            sd_bus_message_append(reply, "ss", e->sensor->name, e->node);
+            sd_bus_message_append_array(reply, 'd', e->pct, e->ctr * sizeof(double));
+            sd_bus_message_close_container(reply);
+        }
+        sd_bus_message_close_container(reply);
+        sd_bus_send(NULL, reply, NULL);
         sd_bus_message_unref(reply);
+    } else {
+        sd_bus_reply_method_errno(fusion->m, EIO, NULL);
     }
     
-    /* Properly free dev if needed */
+    char id[sizeof(fusion->id)];
+    strcpy(id, fusion->id);
+    map_remove(fusions, id);
+}
+
+static void fusion_dtor(void *data) {
+    sensor_fusion_t *fusion = (sensor_fusion_t *)data;
+    sd_bus_message_unref(fusion->m);
+    free(fusion);
+}
+
+static void capture_dtor(void *data) {
+    sensor_capture_t *cap = (sensor_capture_t *)data;
+    m_deregister_fd(cap->fd);
+    sd_bus_message_unref(cap->m);
+    free(cap->interface);
+    free(cap->settings);
+    free(cap->pct);
+    free(cap->ts);
+    free(cap);
+}
+
+static void stream_sample(sensor_stream_t *st) {
+    void *dev = NULL;
+    sensor_t *sensor = find_available_sensor(st->sensor, st->interface, &dev);
     if (sensor) {
+        double pct = 0.0;
+        uint64_t ts;
+        if (capture_once(sensor, dev, &pct, &ts, 1, st->settings) == 1) {
+            const char *node = NULL;
+            sensor->fetch_props_dev(dev, &node, NULL);
+            sd_bus_emit_signal(bus, st->path, stream_interface, "Sample", "sd", node, pct);
+            stream_adapt(st, pct);
+        } else {
+            m_log("Stream %u: failed to capture.\n", st->id);
+        }
         sensor->destroy_dev(dev);
+    } else {
+        m_log("Stream %u: no sensor available.\n", st->id);
+    }
+}
+
+static void stream_dtor(void *data) {
+    sensor_stream_t *st = (sensor_stream_t *)data;
+    m_deregister_fd(st->fd); // this will automatically close it!
+    sd_bus_slot_unref(st->slot);
+    sd_bus_slot_unref(st->track_slot);
+    m_log("Freeing stream %u\n", st->id);
+    free(st->interface);
+    free(st->settings);
+    free(st->sender);
+    free(st);
+}
+
+/* Stop streams whose owner left the bus */
+static int on_name_owner_changed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    sensor_stream_t *st = (sensor_stream_t *)userdata;
+    const char *name = NULL, *old_owner = NULL, *new_owner = NULL;
+    if (sd_bus_message_read(m, "sss", &name, &old_owner, &new_owner) >= 0 && new_owner[0] == '\0') {
+        m_log("'%s' left the bus; stopping stream %u.\n", name, st->id);
+        map_remove(streams, st->path);
+    }
+    return 0;
+}
+
+static int method_startstream(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    ASSERT_AUTH();
+    
+    const char *interface = NULL;
+    const char *settings = NULL;
+    unsigned int interval;
+    int r = sd_bus_message_read(m, "sus", &interface, &interval, &settings);
+    if (r < 0) {
+        m_log("Failed to parse parameters: %s\n", strerror(-r));
+        return r;
+    }
+    
+    if (interval < SENSOR_MIN_STREAM_INTERVAL) {
+        sd_bus_error_set_const(ret_error, SD_BUS_ERROR_INVALID_ARGS, "Stream interval should be at least 50ms.");
+        return -EINVAL;
+    }
+    
+    /* Check that requested sensor is actually available */
+    void *dev = NULL;
+    sensor_t *sensor = find_available_sensor(userdata, interface, &dev);
+    if (!sensor) {
+        sd_bus_error_set_errno(ret_error, ENODEV);
+        return -ENODEV;
+    }
+    sensor->destroy_dev(dev);
+    
+    sensor_stream_t *st = calloc(1, sizeof(sensor_stream_t));
+    if (!st) {
+        sd_bus_error_set_errno(ret_error, ENOMEM);
+        return -ENOMEM;
+    }
+    st->id = stream_ctr++;
+    st->interval = interval;
+    st->cur_interval = interval;
+    st->delta = SENSOR_STREAM_DELTA;
+    st->threshold = SENSOR_STREAM_THRESHOLD;
+    st->sensor = userdata;
+    st->interface = strdup(interface);
+    st->settings = strdup(settings);
+    st->sender = strdup(sd_bus_message_get_sender(m));
+    snprintf(st->path, sizeof(st->path) - 1, "%s/Stream%u", object_path, st->id);
+    
+    char match[256];
+    snprintf(match, sizeof(match), 
+             "type='signal',sender='org.freedesktop.DBus',interface='org.freedesktop.DBus',member='NameOwnerChanged',arg0='%s'", 
+             st->sender);
+    r = sd_bus_add_match(bus, &st->track_slot, match, on_name_owner_changed, st);
+    r += sd_bus_add_object_vtable(bus, &st->slot, st->path, stream_interface, vtable_stream, st);
+    
+    st->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    m_register_fd(st->fd, true, st);
+    map_put(streams, st->path, st);
+    if (r < 0) {
+        map_remove(streams, st->path);
+        sd_bus_error_set_errno(ret_error, -r);
+        return r;
+    }
+    
+    /* First sample right away, then one every interval ms */
+    set_stream_timer(st, interval, true);
+    
+    m_log("Starting stream %u (%u ms) for '%s'\n", st->id, interval, st->sender);
+    return sd_bus_reply_method_return(m, "o", st->path);
+}
+
+static void set_stream_timer(sensor_stream_t *st, unsigned int interval, bool now) {
+    struct itimerspec timerValue = {{0}};
+    timerValue.it_interval.tv_sec = interval / 1000;
+    timerValue.it_interval.tv_nsec = 1000 * 1000 * (interval % 1000); // ms
+    if (now) {
+        timerValue.it_value.tv_nsec = 1;
+    } else {
+        timerValue.it_value = timerValue.it_interval;
+    }
+    timerfd_settime(st->fd, 0, &timerValue, NULL);
+    st->cur_interval = interval;
+}
+
+/*
+ * Adaptive mode: while samples stay within delta from previous one,
+ * sampling interval is doubled up to max_interval;
+ * as soon as a sample changes more than threshold, it snaps back to interval.
+ */
+static void stream_adapt(sensor_stream_t *st, double pct) {
+    if (st->max_interval <= st->interval) {
+        return;
+    }
+    
+    unsigned int next = st->cur_interval;
+    if (st->has_last) {
+        const double diff = fabs(pct - st->last_pct);
+        if (diff > st->threshold) {
+            next = st->interval;
+        } else if (diff <= st->delta) {
+            next = st->cur_interval * 2;
+            if (next > st->max_interval) {
+                next = st->max_interval;
+            }
+        }
+    }
+    st->last_pct = pct;
+    st->has_last = true;
+    
+    if (next != st->cur_interval) {
+        m_log("Stream %u: interval %u -> %u ms.\n", st->id, st->cur_interval, next);
+        set_stream_timer(st, next, false);
+    }
+}
+
+static int set_stream_adaptive(sd_bus *b, const char *path, const char *interface, const char *property, 
+                               sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    /* Only stream owner can change it */
+    sensor_stream_t *st = map_get(streams, path);
+    if (!st || strcmp(st->sender, sd_bus_message_get_sender(m)) != 0) {
+        m_log("Failed to validate stream.\n");
+        sd_bus_error_set_errno(ret_error, EPERM);
+        return -EPERM;
+    }
+    
+    int r;
+    if (!strcmp(property, "MaxInterval")) {
+        r = sd_bus_message_read(m, "u", userdata);
+        if (r >= 0 && st->max_interval <= st->interval && st->cur_interval != st->interval) {
+            /* Adaptive mode disabled: back to requested interval */
+            set_stream_timer(st, st->interval, false);
+        }
+    } else {
+        double val;
+        r = sd_bus_message_read(m, "d", &val);
+        if (r >= 0) {
+            if (val < 0) {
+                sd_bus_error_set_const(ret_error, SD_BUS_ERROR_INVALID_ARGS, "Value should be positive.");
+                return -EINVAL;
+            }
+            *(double *)userdata = val;
+        }
+    }
+    if (r < 0) {
+        m_log("Failed to set %s.\n", property);
     }
-    free(pct);
     return r;
 }
+
+static int method_stopstream(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    const char *obj_path = NULL;
+    int r = sd_bus_message_read(m, "o", &obj_path);
+    if (r < 0) {
+        m_log("Failed to parse parameters: %s\n", strerror(-r));
+        return r;
+    }
+    
+    /* Only stream owner can stop it */
+    sensor_stream_t *st = map_get(streams, obj_path);
+    if (!st || strcmp(st->sender, sd_bus_message_get_sender(m)) != 0) {
+        m_log("Failed to validate stream.\n");
+        sd_bus_error_set_errno(ret_error, EPERM);
+        return -EPERM;
+    }
+    map_remove(streams, obj_path);
+    return sd_bus_reply_method_return(m, NULL);
+}
@@ -14,7 +14,11 @@
  * -> recv_monitor() to retrieve a device from an awoken monitor fd
  * -> destroy_monitor() to free monitor resources
  * 
- * -> capture() that will actually capture frames from device
+ * -> capture() that will actually capture frames from device; it must never sleep between samples.
+ *    Each sample is stored with the monotonic time (us) it was taken at, see sensor_now_usec().
+ * -> capture_interval() to retrieve ms between samples for given device and settings; when > 0,
+ *    sensor module will schedule one single-sample capture() every interval ms on the main loop,
+ *    thus capture() is only asked for multiple samples at once by sensors with no interval.
  * 
  * To add a new sensor, just insert a new define in _SENSORS; note that sensors are priority-ordered: lower int has higher priority.
  * Remeber that sensor's name should contain sensor's define stringified to actually be registered.
@@ -28,6 +32,17 @@
 #define INFO(fmt, ...)
 #endif
 
+#ifdef SENSOR_BENCH
+/* Capture stages are only timed by the sensor_bench harness, see bench/ */
+#define STAGE_START(stage)      struct timespec stage##_start; clock_gettime(CLOCK_MONOTONIC, &stage##_start);
+#define STAGE_END(stage)        sensor_bench_stage(#stage, &stage##_start);
+
+void sensor_bench_stage(const char *stage, const struct timespec *start);
+#else
+#define STAGE_START(stage)
+#define STAGE_END(stage)
+#endif
+
 /* Sensor->name must match its enumeration stringified value */
 #define _SENSORS \
     X(ALS) \
@@ -52,7 +67,8 @@ typedef struct _sensor {
     int (*init_monitor)(void);
     void (*recv_monitor)(void **dev);
     void (*destroy_monitor)(void);  // return number of frames actually captured, or a -errno style error
-    int (*capture)(void *userdata, double *pct, const int num_captures, char *settings);
+    int (*capture)(void *userdata, double *pct, uint64_t *ts, const int num_captures, char *settings);
+    int (*capture_interval)(void *dev, char *settings);
     char obj_path[100];
 } sensor_t;
 
@@ -64,10 +80,20 @@ typedef struct _sensor {
     static int init_monitor(void); \
     static void recv_monitor(void **dev); \
     static void destroy_monitor(void); \
-    static int capture(void *dev, double *pct, const int num_captures, char *settings); \
+    static int capture(void *dev, double *pct, uint64_t *ts, const int num_captures, char *settings); \
+    static int capture_interval(void *dev, char *settings); \
     static void _ctor_ register_sensor(void) { \
-        static sensor_t self = { name, validate_dev, fetch_dev, fetch_props_dev, destroy_dev, init_monitor, recv_monitor, destroy_monitor, capture }; \
+        static sensor_t self = { name, validate_dev, fetch_dev, fetch_props_dev, destroy_dev, init_monitor, recv_monitor, destroy_monitor, capture, capture_interval }; \
         sensor_register_new(&self); \
     }
 
+/* Monotonic timestamp (us) of a sample */
+static inline uint64_t sensor_now_usec(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
 void sensor_register_new(sensor_t *sensor);
+/* Emit LightChanged signal for a sensor that is able to detect light changes by itself (eg: hw thresholds) */
+void sensor_emit_light_changed(const char *name, const char *node, double pct);
@@ -2,19 +2,30 @@
 #include <udev.h>
 #include <iio.h>
 #include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <linux/iio/events.h>
+#include <module/map.h>
 #include "als.h"
 
 #define ALS_NAME            "Als"
 #define ALS_SUBSYSTEM       "iio"
+#define ALS_THRESHOLD_ENV   "CLIGHTD_ALS_THRESHOLD"
+#define ALS_GAIN_ENV        "CLIGHTD_ALS_GAIN"
+#define ALS_LUT_SIZE        1024    // lux values below this are mapped to pct through a lookup table
+#define ALS_BUF_IDLE_MIN    100     // ms; buffer is disabled once no capture happened for 2 intervals, at least this
 #define PROCESS_CHANNEL_BITS(bits)  val = ((int##bits##_t*)p_dat)[i];
 
-// Buffer method has higher prio. See https://gitlab.freedesktop.org/hadess/iio-sensor-proxy/-/merge_requests/352.
-typedef enum { ALS_IIO_BUFFER, ALS_IIO_POLL, ALS_IIO_MAX } als_iio_types;
+/*
+ * Event method has higher prio: when threshold events are armed, it just returns the value read on last event.
+ * Then buffer method. See https://gitlab.freedesktop.org/hadess/iio-sensor-proxy/-/merge_requests/352.
+ */
+typedef enum { ALS_IIO_EVENT, ALS_IIO_BUFFER, ALS_IIO_POLL, ALS_IIO_MAX } als_iio_types;
 
 typedef struct als_device {
     struct udev_device *dev;
     const char *attr_name[ALS_IIO_MAX];
-    double (*capture[ALS_IIO_MAX])(struct als_device *als,  double *pct, const int num_captures, int interval);
+    double (*capture[ALS_IIO_MAX])(struct als_device *als,  double *pct, uint64_t *ts, const int num_captures, int interval);
 } als_device_t;
 
 SENSOR(ALS_NAME);
@@ -23,61 +34,240 @@ SENSOR(ALS_NAME);
 static const char *ill_poll_names[] = { "in_illuminance_input", "in_illuminance0_input", "in_illuminance_raw", "in_intensity_clear_raw" };
 static const char *ill_buff_names[] = { "scan_elements/in_illuminance_en", "scan_elements/in_intensity_both_en" };
 static const char *scale_names[] = { "in_illuminance_scale", "in_intensity_scale" };
+static const char *offset_names[] = { "in_illuminance_offset", "in_intensity_offset" };
+/* channels whose threshold events can be armed; "<prefix>_raw" is used to program thresholds */
+static const char *ev_prefixes[] = { "in_illuminance", "in_illuminance0", "in_intensity_clear", "in_intensity" };
+static const char *ev_dirs[] = { "rising", "falling", "either" };
+
+/*
+ * Per-device calibration, loaded when device is first used and refreshed on udev change events:
+ * lux = (raw + offset) * scale * gain for raw values, input * gain for *_input ones (already in lux).
+ */
+typedef struct {
+    double scale;       // defaults to 1.0
+    double offset;      // defaults to 0.0
+    double gain;        // user supplied gain
+    bool has_scale;     // scale sysattr is exposed; otherwise buffer method uses channel scale
+} als_calib_t;
+
+/* 
+ * Per-device IIO state, kept for the daemon lifetime (until device is removed),
+ * to avoid recreating iio contexts/buffers and udev devices for each capture.
+ */
+typedef struct {
+    struct iio_context *ctx;
+    const struct iio_device *iio_dev;
+    struct iio_channel *ch;
+    struct iio_buffer *rxbuf;   // only exists, ie: buffer is enabled, while captures keep coming
+    als_calib_t calib;
+    double ch_scale;    // buffer channel scale, from libiio; not touched by calibration reloads
+    bool poll_raw;      // poll attribute is a raw value
+    size_t read_size;
+    int attr_fd;        // sysfs illuminance attribute, read with pread()
+    bool buf_failed;    // buffer setup failed: only use poll method
+    int buf_fd;         // rxbuf poll fd, consumed by receive()
+    int idle_fd;        // timer disabling the buffer once captures stop
+    bool has_buf_val;
+    double buf_pct;     // latest sample read from buffer
+    uint64_t buf_ts;
+    int ev_fd;          // iio event fd, when threshold events are armed
+    uint8_t ev_enabled; // bitmask of ev_dirs whose events were enabled
+    int raw_fd;         // sysfs raw attribute, used to program thresholds
+    const char *ev_prefix;
+    double ev_pct;      // value read on last threshold event
+    char *syspath;
+    char *node;
+} als_iio_t;
 
 static struct udev_monitor *mon;
+static map_t *iio_devs;     // syspath -> als_iio_t
+static int threshold_pct;   // thresholds hysteresis, in % of current value; 0 -> disabled
+static double user_gain = 1.0;
+static uint16_t lux_lut[ALS_LUT_SIZE];  // fixed point pct, for integer lux values
+
+MODULE(ALS_NAME);
+
+static bool write_sysattr(const char *syspath, const char *attr, long val) {
+    char path[PATH_MAX + 1];
+    snprintf(path, sizeof(path), "%s/%s", syspath, attr);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool ret = dprintf(fd, "%ld", val) > 0;
+    close(fd);
+    return ret;
+}
+
+static void iio_buffer_stop(als_iio_t *iio);
+
+static void iio_dtor(void *data) {
+    als_iio_t *iio = (als_iio_t *)data;
+    iio_buffer_stop(iio);
+    if (iio->idle_fd >= 0) {
+        m_deregister_fd(iio->idle_fd);
+    }
+    if (iio->ctx) {
+        iio_context_destroy(iio->ctx);
+    }
+    if (iio->attr_fd >= 0) {
+        close(iio->attr_fd);
+    }
+    if (iio->raw_fd >= 0) {
+        close(iio->raw_fd);
+    }
+    if (iio->ev_fd >= 0) {
+        for (int i = 0; i < SIZE(ev_dirs); i++) {
+            if (!(iio->ev_enabled & (1 << i))) {
+                continue;
+            }
+            char attr[128];
+            snprintf(attr, sizeof(attr), "events/%s_thresh_%s_en", iio->ev_prefix, ev_dirs[i]);
+            write_sysattr(iio->syspath, attr, 0);
+        }
+        m_deregister_fd(iio->ev_fd);
+    }
+    free(iio->syspath);
+    free(iio->node);
+    free(iio);
+}
 
-static double iio_poll_capture(struct als_device *als, double *pct, const int num_captures, int interval) {
+static bool sysattr_value(struct udev_device *dev, const char *names[], int size, double *val) {
+    for (int i = 0; i < size; i++) {
+        const char *str = udev_device_get_sysattr_value(dev, names[i]);
+        if (str) {
+            *val = atof(str);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void load_calib(als_iio_t *iio, struct udev_device *dev) {
+    als_calib_t *c = &iio->calib;
+    c->scale = 1.0;
+    c->offset = 0.0;
+    c->gain = user_gain;
+    c->has_scale = sysattr_value(dev, scale_names, SIZE(scale_names), &c->scale);
+    sysattr_value(dev, offset_names, SIZE(offset_names), &c->offset);
+    INFO("[IIO] Calibration: scale: %lf | offset: %lf | gain: %lf.\n", c->scale, c->offset, c->gain);
+}
+
+static inline double calibrate(const als_iio_t *iio, double val, bool raw) {
+    if (raw) {
+        const double scale = iio->calib.has_scale ? iio->calib.scale : iio->ch_scale;
+        val = (val + iio->calib.offset) * scale;
+    }
+    return val * iio->calib.gain;
+}
+
+static void init_lut(void) {
+    for (int i = 0; i < ALS_LUT_SIZE; i++) {
+        lux_lut[i] = lround(compute_value(i) * UINT16_MAX);
+    }
+}
+
+/* Same as compute_value(), through a linear interpolation on lux_lut for common indoor values */
+static double lux_to_pct(double lux) {
+    if (lux < 0 || lux >= ALS_LUT_SIZE - 1) {
+        return compute_value(lux);
+    }
+    const int i = (int)lux;
+    const double frac = lux - i;
+    return (lux_lut[i] + (lux_lut[i + 1] - lux_lut[i]) * frac) / UINT16_MAX;
+}
+
+static als_iio_t *get_iio(struct als_device *als) {
+    if (!iio_devs) {
+        iio_devs = map_new(true, iio_dtor);
+    }
     const char *syspath = udev_device_get_syspath(als->dev);
+    als_iio_t *iio = map_get(iio_devs, syspath);
+    if (!iio) {
+        iio = calloc(1, sizeof(als_iio_t));
+        iio->attr_fd = -1;
+        iio->ev_fd = -1;
+        iio->raw_fd = -1;
+        iio->buf_fd = -1;
+        iio->idle_fd = -1;
+        iio->ch_scale = 1.0;
+        iio->syspath = strdup(syspath);
+        const char *node = udev_device_get_devnode(als->dev);
+        iio->node = strdup(node ? node : "");
+        load_calib(iio, als->dev);
+        map_put(iio_devs, syspath, iio);
+    }
+    return iio;
+}
+
+static int open_sysattr(struct als_device *als, const char *attr) {
+    char path[PATH_MAX + 1];
+    snprintf(path, sizeof(path), "%s/%s", udev_device_get_syspath(als->dev), attr);
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+static bool read_sysattr(int fd, double *val) {
+    char buf[64];
+    ssize_t len = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0) {
+        return false;
+    }
+    buf[len] = '\0';
+    *val = atof(buf);
+    return true;
+}
+
+static bool open_poll_attrs(struct als_device *als, als_iio_t *iio) {
+    if (iio->attr_fd < 0) {
+        iio->attr_fd = open_sysattr(als, als->attr_name[ALS_IIO_POLL]);
+        if (iio->attr_fd < 0) {
+            fprintf(stderr, "Failed to open '%s': %m\n", als->attr_name[ALS_IIO_POLL]);
+            return false;
+        }
+        iio->poll_raw = strstr(als->attr_name[ALS_IIO_POLL], "_raw") != NULL;
+    }
+    return true;
+}
+
+static double iio_poll_capture(struct als_device *als, double *pct, uint64_t *ts, const int num_captures, int interval) {
+    als_iio_t *iio = get_iio(als);
     
-    INFO("[IIO-POLL] Start capture: '%s' syspath.\n", syspath);
+    INFO("[IIO-POLL] Start capture: '%s' syspath.\n", udev_device_get_syspath(als->dev));
     
-    // Load scale value
-    const char *val = NULL;
-    double scale = 1.0; // defaults to 1.0
-    for (int i = 0; i < SIZE(scale_names) && !val; i++) {
-        val = udev_device_get_sysattr_value(als->dev, scale_names[i]);
-        if (val) {
-            scale = atof(val);
-        }
+    if (!open_poll_attrs(als, iio)) {
+        return 0;
     }
-    INFO("[IIO-POLL] Loaded scale: %f.\n", scale);
     
+    /* Some drivers refuse sysfs reads (EBUSY) while buffer is enabled */
+    iio_buffer_stop(iio);
     
     int ctr = 0;
     for (int i = 0; i < num_captures; i++) {
-        struct udev_device *non_cached_dev = udev_device_new_from_syspath(udev, syspath);
-        val = udev_device_get_sysattr_value(non_cached_dev, als->attr_name[ALS_IIO_POLL]);
-        INFO("[IIO-POLL] Read: %s.\n", val);
-        if (val) {
-            double illuminance = atof(val) * scale;
-            ctr++;
-            pct[i] = compute_value(illuminance);
-            INFO("[IIO-POLL] Pct[%d] = %lf\n", i, pct[i]);
-        }
-        udev_device_unref(non_cached_dev);
-        usleep(interval * 1000);
+        double val;
+        if (read_sysattr(iio->attr_fd, &val)) {
+            INFO("[IIO-POLL] Read: %lf.\n", val);
+            ts[ctr] = sensor_now_usec();
+            pct[ctr++] = lux_to_pct(calibrate(iio, val, iio->poll_raw));
+            INFO("[IIO-POLL] Pct[%d] = %lf\n", i, pct[ctr - 1]);
+        }
     }
     return ctr;
 }
 
-static double iio_buffer_capture(struct als_device *als, double *pct, const int num_captures, int interval) {
-    int ctr = 0;
-        
+static bool iio_buffer_open(struct als_device *als, als_iio_t *iio) {
     const char *sysname = udev_device_get_sysname(als->dev);
-    INFO("[IIO-BUF] Start capture: '%s' sysname.\n", sysname);
-    
     
     /* Getting local iio device context */
-    struct iio_context *local_ctx = iio_create_local_context();
-    if (!local_ctx) {
+    iio->ctx = iio_create_local_context();
+    if (!iio->ctx) {
         fprintf(stderr, "Failed to create local iio ctx.\n");
-        return ctr;
+        return false;
     }
     
-    const struct iio_device *dev = iio_context_find_device(local_ctx, sysname);
-    if (!dev) {
+    iio->iio_dev = iio_context_find_device(iio->ctx, sysname);
+    if (!iio->iio_dev) {
         fprintf(stderr, "Couldn't find device '%s': %m\n", sysname);
-        return ctr;
+        return false;
     }
     
     INFO("[IIO-BUF] Found device.\n");
@@ -91,70 +281,319 @@ static double iio_buffer_capture(struct als_device *als, double *pct, const int
     
     INFO("[IIO-BUF] Channel name: '%s'.\n", channel_name);
     
-    struct iio_channel *ch = iio_device_find_channel(dev, channel_name, false);
-    if (!ch) {
+    iio->ch = iio_device_find_channel(iio->iio_dev, channel_name, false);
+    if (!iio->ch) {
         fprintf(stderr, "Failed to fetch '%s' channel: %m\n", channel_name);
-        return ctr;
+        return false;
     }
     
-    if (iio_channel_is_output(ch)) {
+    if (iio_channel_is_output(iio->ch)) {
         fprintf(stderr, "Wrong output channel selected.\n");
-        return ctr;
+        return false;
     }
-    if (!iio_channel_is_scan_element(ch)) {
+    if (!iio_channel_is_scan_element(iio->ch)) {
         fprintf(stderr, "Channel is not a scan element.\n");
-        return ctr;
+        return false;
     }
     
-    iio_channel_enable(ch);
-    if (!iio_channel_is_enabled(ch)) {
+    iio_channel_enable(iio->ch);
+    if (!iio_channel_is_enabled(iio->ch)) {
         fprintf(stderr, "Failed to enable channel '%s'!\n", channel_name);
-        return ctr;
+        return false;
     }
     
-    INFO("[IIO-BUF] Creating buffer.\n");
-    struct iio_buffer *rxbuf = iio_device_create_buffer(dev, 1, false);
-    if (!rxbuf) {
-        fprintf(stderr, "Failed to allocated buffer: %m\n");
-        return ctr;
-    }
-    
-    // Load scale
-    double scale = 1.0; // default to 1.0
-    const struct iio_data_format *fmt = iio_channel_get_data_format(ch);
+    // Load channel scale, if not exposed as sysattr
+    const struct iio_data_format *fmt = iio_channel_get_data_format(iio->ch);
     if (!fmt) {
         fprintf(stderr, "Failed to fetch channel format.\n");
-        return ctr;
-    }
-    if (fmt->with_scale) {
-        scale = fmt->scale;
+        return false;
     }
+    iio->ch_scale = fmt->with_scale ? fmt->scale : 1.0; // default to 1.0
+    iio->read_size = fmt->bits / 8;
     
     INFO("[IIO-BUF] Data fmt: bits: %d | signed: %d | len: %d | rep: %d | scale: %f | has_scale: %d | shift: %d.\n", 
            fmt->bits, fmt->is_signed, fmt->length, fmt->repeat, fmt->scale, fmt->with_scale, fmt->shift);
+    
+    iio->idle_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (iio->idle_fd < 0) {
+        fprintf(stderr, "Failed to create buffer idle timer: %m\n");
+        return false;
+    }
+    m_register_fd(iio->idle_fd, true, iio);
+    return true;
+}
 
-    const size_t read_size = fmt->bits / 8;
-    for (int i = 0; i < num_captures; i++) {
-        int ret = iio_buffer_refill(rxbuf);
-        INFO("[IIO-BUF] Refill ret: %d/%ld\n", ret, read_size);
-        if (ret == read_size) {
+/* Enable the buffer: samples are then consumed by receive() as soon as they are pushed */
+static bool iio_buffer_start(als_iio_t *iio) {
+    INFO("[IIO-BUF] Creating buffer.\n");
+    iio->rxbuf = iio_device_create_buffer(iio->iio_dev, 1, false);
+    if (!iio->rxbuf) {
+        fprintf(stderr, "Failed to allocated buffer: %m\n");
+        return false;
+    }
+    
+    /* receive() must never block */
+    if (iio_buffer_set_blocking_mode(iio->rxbuf, false) < 0) {
+        fprintf(stderr, "Failed to set non blocking buffer.\n");
+        iio_buffer_stop(iio);
+        return false;
+    }
+    iio->buf_fd = iio_buffer_get_poll_fd(iio->rxbuf);
+    if (iio->buf_fd < 0) {
+        fprintf(stderr, "Failed to fetch buffer fd.\n");
+        iio_buffer_stop(iio);
+        return false;
+    }
+    m_register_fd(iio->buf_fd, false, iio); // fd is owned by libiio
+    return true;
+}
+
+static void set_idle_timer(als_iio_t *iio, int timeout) {
+    struct itimerspec timerValue = {{0}};
+    timerValue.it_value.tv_sec = timeout / 1000;
+    timerValue.it_value.tv_nsec = 1000 * 1000 * (timeout % 1000); // ms
+    timerfd_settime(iio->idle_fd, 0, &timerValue, NULL);
+}
+
+/* Disable the buffer: a triggered sensor stops sampling, and sysfs attributes can be read again */
+static void iio_buffer_stop(als_iio_t *iio) {
+    if (iio->rxbuf) {
+        INFO("[IIO-BUF] Disabling buffer.\n");
+        if (iio->buf_fd >= 0) {
+            m_deregister_fd(iio->buf_fd);
+            iio->buf_fd = -1;
+        }
+        iio_buffer_destroy(iio->rxbuf);
+        iio->rxbuf = NULL;
+        set_idle_timer(iio, 0);
+    }
+    iio->has_buf_val = false;
+}
+
+/* Buffer fd is readable: keep the latest pushed sample */
+static void iio_buffer_consume(als_iio_t *iio) {
+    ssize_t ret;
+    while ((ret = iio_buffer_refill(iio->rxbuf)) > 0) {
+        INFO("[IIO-BUF] Refill ret: %ld/%ld\n", ret, iio->read_size);
+        if (ret == iio->read_size) {
             int64_t val = 0;
-            if (ret == read_size) {
-                iio_channel_read(ch, rxbuf, &val, read_size);
-                INFO("[IIO-BUF] Read %ld\n", val);
-                double illuminance = (double)val * scale;
-                ctr++;
-                pct[i] = compute_value(illuminance);
-                INFO("[IIO-BUF] Pct[%d] = %lf\n", i, pct[i]);
-            }
+            iio_channel_read(iio->ch, iio->rxbuf, &val, iio->read_size);
+            INFO("[IIO-BUF] Read %ld\n", val);
+            iio->buf_pct = lux_to_pct(calibrate(iio, (double)val, true));
+            iio->buf_ts = sensor_now_usec();
+            iio->has_buf_val = true;
+        }
+    }
+    if (ret < 0 && ret != -EAGAIN) {
+        fprintf(stderr, "Failed to refill buffer: %s\n", strerror(-ret));
+        iio_buffer_stop(iio);
+    }
+}
+
+static double iio_buffer_capture(struct als_device *als, double *pct, uint64_t *ts, const int num_captures, int interval) {
+    als_iio_t *iio = get_iio(als);
+    
+    INFO("[IIO-BUF] Start capture: '%s' sysname.\n", udev_device_get_sysname(als->dev));
+    
+    if (iio->buf_failed) {
+        return 0;
+    }
+    if (!iio->ctx && !iio_buffer_open(als, iio)) {
+        if (iio->idle_fd >= 0) {
+            m_deregister_fd(iio->idle_fd);
+            iio->idle_fd = -1;
+        }
+        if (iio->ctx) {
+            iio_context_destroy(iio->ctx);
+            iio->ctx = NULL;
+        }
+        iio->buf_failed = true;
+        return 0;
+    }
+    
+    int ctr = 0;
+    if (!iio->rxbuf) {
+        /*
+         * Buffer is disabled: take current value through sysfs, if possible, then enable the buffer 
+         * for next captures. Report-on-change sensors (eg: hid-sensor-als) only push samples when light changes,
+         * thus the sysfs value stays the latest one until a sample is pushed.
+         */
+        if (als->capture[ALS_IIO_POLL]) {
+            ctr = iio_poll_capture(als, pct, ts, num_captures, interval);
+        }
+        if (!iio_buffer_start(iio)) {
+            iio->buf_failed = true;
+            return ctr;
         }
-        usleep(interval * 1000);
+        if (ctr > 0) {
+            iio->buf_pct = pct[ctr - 1];
+            iio->buf_ts = ts[ctr - 1];
+            iio->has_buf_val = true;
+        }
+    } else if (iio->has_buf_val) {
+        /* Samples are only refreshed by the device: more of them would just be copies of the latest one */
+        INFO("[IIO-BUF] Using latest buffer sample: %lf.\n", iio->buf_pct);
+        pct[ctr] = iio->buf_pct;
+        ts[ctr++] = iio->buf_ts;
     }
-    iio_buffer_destroy(rxbuf);
-    iio_context_destroy(local_ctx);
+    
+    /* Keep the buffer enabled while captures keep coming */
+    set_idle_timer(iio, 2 * interval > ALS_BUF_IDLE_MIN ? 2 * interval : ALS_BUF_IDLE_MIN);
     return ctr;
 }
 
+static double iio_event_capture(struct als_device *als, double *pct, uint64_t *ts, const int num_captures, int interval) {
+    als_iio_t *iio = get_iio(als);
+    if (iio->ev_fd < 0) {
+        return 0;
+    }
+    /* 
+     * Value did not move past thresholds since last event, otherwise we would have been woken up:
+     * more samples would just be copies of it.
+     */
+    INFO("[IIO-EVENT] Using last event value: %lf.\n", iio->ev_pct);
+    pct[0] = iio->ev_pct;
+    ts[0] = sensor_now_usec();
+    return 1;
+}
+
+/* Read current value and program thresholds around it */
+static bool update_thresholds(als_iio_t *iio) {
+    double raw, val;
+    iio_buffer_stop(iio);
+    if (!read_sysattr(iio->raw_fd, &raw) || !read_sysattr(iio->attr_fd, &val)) {
+        return false;
+    }
+    iio->ev_pct = lux_to_pct(calibrate(iio, val, iio->poll_raw));
+    
+    const long delta = raw * threshold_pct / 100 + 1;
+    char attr[128];
+    snprintf(attr, sizeof(attr), "events/%s_thresh_rising_value", iio->ev_prefix);
+    bool ret = write_sysattr(iio->syspath, attr, raw + delta);
+    snprintf(attr, sizeof(attr), "events/%s_thresh_falling_value", iio->ev_prefix);
+    ret = write_sysattr(iio->syspath, attr, raw > delta ? raw - delta : 0) && ret;
+    INFO("[IIO-EVENT] Thresholds set around %lf raw (+-%ld).\n", raw, delta);
+    return ret;
+}
+
+static void arm_events(als_device_t *als) {
+    if (!validate_dev(als) || !als->capture[ALS_IIO_EVENT]) {
+        return;
+    }
+    
+    als_iio_t *iio = get_iio(als);
+    if (iio->ev_fd >= 0 || !open_poll_attrs(als, iio)) {
+        return;
+    }
+    
+    iio->ev_prefix = als->attr_name[ALS_IIO_EVENT];
+    char attr[128];
+    snprintf(attr, sizeof(attr), "%s_raw", iio->ev_prefix);
+    if (iio->raw_fd < 0) {
+        iio->raw_fd = open_sysattr(als, attr);
+        if (iio->raw_fd < 0) {
+            fprintf(stderr, "Failed to open '%s': %m\n", attr);
+            return;
+        }
+    }
+    
+    int fd = open(iio->node, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open '%s': %m\n", iio->node);
+        return;
+    }
+    int ev_fd = -1;
+    int r = ioctl(fd, IIO_GET_EVENT_FD_IOCTL, &ev_fd);
+    close(fd);
+    if (r < 0 || ev_fd < 0) {
+        fprintf(stderr, "Failed to fetch '%s' event fd: %m\n", iio->node);
+        return;
+    }
+    fcntl(ev_fd, F_SETFL, fcntl(ev_fd, F_GETFL) | O_NONBLOCK);
+    
+    iio->ev_enabled = 0;
+    if (update_thresholds(iio)) {
+        for (int i = 0; i < SIZE(ev_dirs); i++) {
+            /* "either" is only used by drivers that do not expose separate rising and falling events */
+            if (!strcmp(ev_dirs[i], "either") && iio->ev_enabled) {
+                break;
+            }
+            snprintf(attr, sizeof(attr), "events/%s_thresh_%s_en", iio->ev_prefix, ev_dirs[i]);
+            if (write_sysattr(iio->syspath, attr, 1)) {
+                iio->ev_enabled |= 1 << i;
+            }
+        }
+    }
+    if (iio->ev_enabled == 0) {
+        fprintf(stderr, "Failed to arm '%s' threshold events.\n", iio->node);
+        close(ev_fd);
+        return;
+    }
+    iio->ev_fd = ev_fd;
+    m_register_fd(ev_fd, true, iio);
+    INFO("[IIO-EVENT] Armed '%s' threshold events.\n", iio->node);
+}
+
+static int arm_dev(struct udev_device *dev, void *userdata) {
+    als_device_t als = { .dev = dev };
+    arm_events(&als);
+    return 0;
+}
+
+static void module_pre_start(void) {
+    
+}
+
+static bool check(void) {
+    return true;
+}
+
+static bool evaluate(void) {
+    return true;
+}
+
+static void init(void) {
+    init_lut();
+    if (getenv(ALS_GAIN_ENV)) {
+        user_gain = strtod(getenv(ALS_GAIN_ENV), NULL);
+        if (user_gain <= 0) {
+            user_gain = 1.0;
+        }
+        printf("Overridden default als gain: %lf.\n", user_gain);
+    }
+    if (getenv(ALS_THRESHOLD_ENV)) {
+        threshold_pct = strtol(getenv(ALS_THRESHOLD_ENV), NULL, 10);
+        printf("Overridden default als threshold: %d%%.\n", threshold_pct);
+    }
+    if (threshold_pct > 0) {
+        udev_devices_foreach(ALS_SUBSYSTEM, NULL, arm_dev, NULL);
+    }
+}
+
+static void receive(const msg_t *msg, const void *userdata) {
+    if (!msg->is_pubsub) {
+        als_iio_t *iio = (als_iio_t *)msg->fd_msg->userptr;
+        if (msg->fd_msg->fd == iio->buf_fd) {
+            iio_buffer_consume(iio);
+        } else if (msg->fd_msg->fd == iio->idle_fd) {
+            uint64_t t;
+            read(msg->fd_msg->fd, &t, sizeof(uint64_t));
+            iio_buffer_stop(iio);
+        } else {
+            struct iio_event_data ev;
+            /* Drain all queued events: we only care about current value */
+            while (read(msg->fd_msg->fd, &ev, sizeof(ev)) == sizeof(ev));
+            if (update_thresholds(iio)) {
+                sensor_emit_light_changed(ALS_NAME, iio->node, iio->ev_pct);
+            }
+        }
+    }
+}
+
+static void destroy(void) {
+    
+}
+
 static bool validate_dev(void *dev) {
     als_device_t *als = (als_device_t *)dev;
     
@@ -179,6 +618,18 @@ static bool validate_dev(void *dev) {
             break;
         }
     }
+    
+    /* Threshold events need poll method to read the value that triggered them */
+    for (int i = 0; i < SIZE(ev_prefixes) && threshold_pct > 0 && als->capture[ALS_IIO_POLL]; i++) {
+        char attr[128];
+        snprintf(attr, sizeof(attr), "events/%s_thresh_rising_value", ev_prefixes[i]);
+        if (udev_device_get_sysattr_value(als->dev, attr)) {
+            als->attr_name[ALS_IIO_EVENT] = ev_prefixes[i];
+            als->capture[ALS_IIO_EVENT] = iio_event_capture;
+            INFO("Threshold events available, using '%s' channel\n", ev_prefixes[i]);
+            break;
+        }
+    }
     return valid;
 }
 
@@ -187,14 +638,14 @@ static void fetch_dev(const char *interface, void **dev) {
     /* Check if any device exposes requested sysattr */
     for (int i = 0; i < SIZE(ill_buff_names) && !d; i++) {
         /* Only check existence for needed sysattr */
-        const udev_match match = { .sysattr_key = ill_buff_names[i] };
+        const udev_match match = { .sysattr_key = ill_buff_names[i], .cached = true };
         get_udev_device(interface, ALS_SUBSYSTEM, &match, NULL, &d);
     }
     
     if (!d) {
         for (int i = 0; i < SIZE(ill_poll_names) && !d; i++) {
             /* Only check existence for needed sysattr */
-            const udev_match match = { .sysattr_key = ill_poll_names[i] };
+            const udev_match match = { .sysattr_key = ill_poll_names[i], .cached = true };
             get_udev_device(interface, ALS_SUBSYSTEM, &match, NULL, &d);
         }
     }
@@ -230,14 +681,32 @@ static void recv_monitor(void **dev) {
     struct udev_device *d = udev_monitor_receive_device(mon);
     als_device_t *als = calloc(1, sizeof(als_device_t));
     als->dev = d;
+    if (d) {
+        const char *action = udev_device_get_action(d);
+        if (action && !strcmp(action, UDEV_ACTION_RM)) {
+            /* Release any resource held on removed device */
+            if (iio_devs) {
+                map_remove(iio_devs, udev_device_get_syspath(d));
+            }
+        } else if (action && !strcmp(action, UDEV_ACTION_ADD)) {
+            arm_events(als);
+        } else if (action && !strcmp(action, UDEV_ACTION_CHANGE) && iio_devs) {
+            /* Device settings (eg: scale) may have changed: refresh its calibration */
+            als_iio_t *iio = map_get(iio_devs, udev_device_get_syspath(d));
+            if (iio) {
+                load_calib(iio, d);
+            }
+        }
+    }
     *dev = als;
 }
 
 static void destroy_monitor(void) {
     udev_monitor_unref(mon);
+    map_free(iio_devs);
 }
 
-static int capture(void *dev, double *pct, const int num_captures, char *settings) {
+static int capture(void *dev, double *pct, uint64_t *ts, const int num_captures, char *settings) {
     int interval;
     parse_settings(settings, &interval);
 
@@ -246,8 +715,23 @@ static int capture(void *dev, double *pct, const int num_captures, char *setting
     // Try buffer then poll methods, if both are available
     for (int i = 0; i < ALS_IIO_MAX && ret == 0; i++) {
         if (als->capture[i]) {
-            ret = als->capture[i](als, pct, num_captures, interval);
+            ret = als->capture[i](als, pct, ts, num_captures, interval);
         }
     }
     return ret;
 }
+
+static int capture_interval(void *dev, char *settings) {
+    /* Threshold events: value is already known, no need to pace samples */
+    als_device_t *als = (als_device_t *)dev;
+    if (als->capture[ALS_IIO_EVENT] && iio_devs) {
+        als_iio_t *iio = map_get(iio_devs, udev_device_get_syspath(als->dev));
+        if (iio && iio->ev_fd >= 0) {
+            return 0;
+        }
+    }
+    
+    int interval;
+    parse_settings(settings, &interval);
+    return interval;
+}
@@ -5,6 +5,13 @@
 #include "camera.h"
 #include <jpeglib.h>
 
+#define CAMERA_SESSION_ENV          "CLIGHTD_CAMERA_SESSION_TIMEOUT"
+#define CAMERA_NUM_BUFFERS          4
+#define CAMERA_WIDTH                160
+#define CAMERA_HEIGHT               120
+#define CAMERA_MAX_SCANLINES        16 // max number of scanlines decoded by each jpeg_read_scanlines() call
+#define CAMERA_MAX_CTRLS            64 // max number of cached controls for each device
+
 struct buffer {
     uint8_t *start;
     size_t length;
@@ -13,20 +20,49 @@ struct buffer {
 struct mjpeg_dec {
     struct jpeg_decompress_struct cinfo;
     struct jpeg_error_mgr err;
+    uint8_t *scratch; // decoded frame storage, reused by every frame of the session
+    size_t scratch_size;
+    uint32_t width; // decoded (possibly downscaled) frame width
+    uint32_t height; // decoded (possibly downscaled) frame height
     int (*dec_cb)(uint8_t **frame, int len);
 };
 
+struct ctrl_info {
+    uint32_t id;
+    int32_t def;
+    int32_t cur; // last known value
+};
+
+/* Per-device controls, enumerated once through VIDIOC_QUERY_EXT_CTRL */
+struct ctrl_cache {
+    struct ctrl_info ctrls[CAMERA_MAX_CTRLS];
+    int num;
+};
+
 struct state {
     int device_fd;
+    char *devnode;
+    char *settings; // settings the stream has been configured with
+    bool streaming; // whether device is configured and streaming, ie: a session is alive
     uint32_t pixelformat;
     uint32_t width; // real width, can be cropped
     uint32_t height; // real height, can be cropped
-    struct buffer buf;
+    uint32_t stride; // bytes per line, including padding
+    bool hw_crop; // crop area has been pushed down to the driver, that only delivers the region of interest
+    bool no_hw_crop; // driver does not support crop selection
+    struct buffer bufs[CAMERA_NUM_BUFFERS];
+    uint32_t num_bufs; // number of buffers actually mapped
     struct mjpeg_dec *decoder;
+    struct ctrl_cache *ctrls; // device controls cache; NULL if unsupported
+    struct v4l2_ext_control pending[CAMERA_MAX_CTRLS]; // controls to be set by next apply_camera_controls()
+    uint32_t num_pending;
 };
 
 static int set_camera_fmt(void);
 static int check_camera_caps(void);
+static void load_camera_controls(void);
+static void forget_camera_controls(const char *devnode);
+static void apply_camera_controls(void);
 static void create_decoder(void);
 static int mjpeg_to_gray(uint8_t **img_data, int size);
 static void destroy_decoder(void);
@@ -37,10 +73,21 @@ static int start_stream(void);
 static int stop_stream(void);
 static int send_frame(struct v4l2_buffer *buf);
 static int recv_frame(struct v4l2_buffer *buf);
-static double compute_brightness(unsigned int size);
+static double compute_brightness(uint32_t index, unsigned int size);
+static uint64_t frame_timestamp(const struct v4l2_buffer *buf);
+static void set_camera_crop(void);
+static void reset_camera_crop(void);
+static int start_session(char *settings);
+static int update_session_settings(char *settings);
+static int restart_stream(void);
+static void set_session_timer(int timeout);
+static void destroy_session(void);
 
-static struct state state;
+static struct state state = { .device_fd = -1 };
 static struct udev_monitor *mon;
+static int session_fd = -1;
+static int session_timeout; // ms; 0 -> warm session disabled
+static map_t *ctrl_caches; // devnode -> struct ctrl_cache
 static const __u32 supported_fmts[] = {
     V4L2_PIX_FMT_GREY,
     V4L2_PIX_FMT_YUYV,
@@ -49,19 +96,97 @@ static const __u32 supported_fmts[] = {
 
 SENSOR(CAMERA_NAME);
 
+MODULE(CAMERA_NAME);
+
+static void module_pre_start(void) {
+    
+}
+
+static bool check(void) {
+    return true;
+}
+
+static bool evaluate(void) {
+    return true;
+}
+
+static void init(void) {
+    if (getenv(CAMERA_SESSION_ENV)) {
+        session_timeout = strtol(getenv(CAMERA_SESSION_ENV), NULL, 10);
+        printf("Overridden default camera session timeout: %d ms.\n", session_timeout);
+    }
+    if (session_timeout > 0) {
+        session_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        if (session_fd >= 0) {
+            m_register_fd(session_fd, true, NULL);
+        } else {
+            /* Without its timer, a warm session would never be closed: close device after each capture */
+            fprintf(stderr, "Failed to create camera session timer: %m\n");
+            session_timeout = 0;
+        }
+    } else {
+        session_timeout = 0;
+    }
+}
+
+static void receive(const msg_t *msg, const void *userdata) {
+    if (!msg->is_pubsub) {
+        /* Session idle timer expired; release the device */
+        uint64_t t;
+        read(msg->fd_msg->fd, &t, sizeof(uint64_t));
+        INFO("Camera session timed out.\n");
+        destroy_session();
+    }
+}
+
+static void destroy(void) {
+    destroy_session();
+    map_free(stored_values);
+    map_free(ctrl_caches);
+}
+
 static bool validate_dev(void *dev) {
     const char *capture_prop = udev_device_get_property_value(dev, CAMERA_CAPTURE_PROP_NAME);
     if (!capture_prop || strcmp(capture_prop, CAMERA_CAPTURE_PROP_VAL) != 0) {
         // Do nothing for non capture devices. This filter is useful when called on a new device from monitor.
         return false;
     }
-    state.device_fd = open(udev_device_get_devnode(dev), O_RDWR);
+    const char *devnode = udev_device_get_devnode(dev);
+    const char *action = udev_device_get_action(dev);
+    if (state.streaming) {
+        if (!strcmp(state.devnode, devnode)) {
+            if (action && !strcmp(action, UDEV_ACTION_RM)) {
+                /* Device held by warm session has been removed */
+                destroy_session();
+                forget_camera_controls(devnode);
+            }
+            /* Device is already opened and validated by warm session */
+            return true;
+        }
+        if (action) {
+            /* 
+             * Udev event for another device: leave the warm session alone.
+             * Device is only opened, and its caps checked, once it is captured.
+             */
+            if (!strcmp(action, UDEV_ACTION_RM)) {
+                forget_camera_controls(devnode);
+            }
+            return true;
+        }
+        /* Only a single device is held open at a time */
+        destroy_session();
+    }
+    state.device_fd = open(devnode, O_RDWR);
     if (state.device_fd >= 0) {
+        state.devnode = strdup(devnode);
         return check_camera_caps() == 0;
     }
     /* Always return true if action is "remove", ie: when called by udev monitor */
-    const char *action = udev_device_get_action(dev);
-    return action && !strcmp(action, UDEV_ACTION_RM);
+    if (action && !strcmp(action, UDEV_ACTION_RM)) {
+        forget_camera_controls(devnode);
+        return true;
+    }
+    return false;
 }
 
 static void fetch_dev(const char *interface, void **dev) {
@@ -69,7 +194,7 @@ static void fetch_dev(const char *interface, void **dev) {
     // and always start from greater sysnum (so that /dev/video2 has precedence over /dev/video0, when present).
     // This means that external webcam are always preferred to internal ones,
     // as they tend to have better resolution and increased image quality.
-    get_udev_device(interface, CAMERA_SUBSYSTEM, &(udev_match){.prop_key=CAMERA_CAPTURE_PROP_NAME, .prop_val=CAMERA_CAPTURE_PROP_VAL, .last_added = true}, NULL, (struct udev_device **)dev);
+    get_udev_device(interface, CAMERA_SUBSYSTEM, &(udev_match){.prop_key=CAMERA_CAPTURE_PROP_NAME, .prop_val=CAMERA_CAPTURE_PROP_VAL, .last_added = true, .cached = true}, NULL, (struct udev_device **)dev);
 }
 
 static void fetch_props_dev(void *dev, const char **node, const char **action) {
@@ -83,12 +208,10 @@ static void fetch_props_dev(void *dev, const char **node, const char **action) {
 
 static void destroy_dev(void *dev) {
     udev_device_unref(dev);
-    if (state.device_fd >= 0) {
-        close(state.device_fd);
+    /* Warm session keeps the device opened until its timer expires */
+    if (!state.streaming) {
+        destroy_session();
     }
-    /* reset state */
-    memset(&state, 0, sizeof(struct state));
-    state.device_fd = -1;
 }
 
 static int init_monitor(void) {
@@ -103,27 +226,295 @@ static void destroy_monitor(void) {
     udev_monitor_unref(mon);
 }
 
-static int capture(void *dev, double *pct, const int num_captures, char *settings) {
+static int capture(void *dev, double *pct, uint64_t *ts, const int num_captures, char *settings) {
     int ctr = 0;
     
+    STAGE_START(setup);
+    if (!state.streaming) {
+        if (start_session(settings) != 0) {
+            destroy_session();
+            return ctr;
+        }
+    } else {
+        INFO("Reusing warm session for '%s'.\n", state.devnode);
+        if (update_session_settings(settings) != 0) {
+            destroy_session();
+            return ctr;
+        }
+    }
+    STAGE_END(setup);
+    
+    /*
+     * Queue up to num_bufs buffers upfront: while we compute brightness
+     * for a frame, driver keeps filling the other queued buffers.
+     * A buffer gets requeued only if more captures than the ones 
+     * already queued are needed, so that no buffer is left queued
+     * (and filled with stale frames) once we are done.
+     */
+    int queued = 0;
+    for (int i = 0; i < state.num_bufs && i < num_captures; i++) {
+        struct v4l2_buffer buf = { .type = V4L2_BUF_TYPE_VIDEO_CAPTURE, .memory = V4L2_MEMORY_MMAP, .index = i };
+        if (send_frame(&buf) == 0) {
+            queued++;
+        }
+    }
+    
+    bool with_err = queued == 0;
+    for (int i = 0; i < num_captures && !with_err; i++) {
+        struct v4l2_buffer buf = { .type = V4L2_BUF_TYPE_VIDEO_CAPTURE, .memory = V4L2_MEMORY_MMAP};
+        STAGE_START(dequeue);
+        if (recv_frame(&buf) == 0) {
+            STAGE_END(dequeue);
+            queued--;
+            ts[ctr] = frame_timestamp(&buf);
+            pct[ctr++] = compute_brightness(buf.index, buf.bytesused);
+            if (i + queued + 1 < num_captures) {
+                if (send_frame(&buf) == 0) {
+                    queued++;
+                }
+            }
+        } else {
+            with_err = true;
+        }
+        with_err |= queued == 0 && i + 1 < num_captures;
+    }
+    
+    STAGE_START(teardown);
+    if (session_timeout > 0 && !with_err) {
+        /* Keep the device streaming for session_timeout ms, waiting for next capture */
+        set_session_timer(session_timeout);
+    } else {
+        destroy_session();
+    }
+    STAGE_END(teardown);
+    return ctr;
+}
+
+static int capture_interval(void *dev, char *settings) {
+    /* Frames are paced by the device itself */
+    return 0;
+}
+
+static int start_session(char *settings) {
+    state.settings = strdup(settings ? settings : "");
+    /* Settings are applied before format, as crop area may be pushed down to the driver */
+    load_camera_controls();
+    set_camera_settings(&state, settings);
+    apply_camera_controls();
+    set_camera_crop();
     if (set_camera_fmt() == 0 && init_mmap() == 0 && start_stream() == 0) {
-        set_camera_settings(&state, settings);
+        state.streaming = true;
         create_decoder();
-        for (int i = 0; i < num_captures; i++) {
-            struct v4l2_buffer buf = { .type = V4L2_BUF_TYPE_VIDEO_CAPTURE, .memory = V4L2_MEMORY_MMAP};
-            if (send_frame(&buf) == 0 && recv_frame(&buf) == 0) {
-                pct[ctr++] = compute_brightness(buf.bytesused);
-            }
+        return 0;
+    }
+    restore_camera_settings(&state);
+    apply_camera_controls();
+    return -1;
+}
+
+static int update_session_settings(char *settings) {
+    if (!settings) {
+        settings = "";
+    }
+    if (strcmp(state.settings, settings) != 0) {
+        INFO("Settings changed; updating warm session.\n");
+        const bool had_hw_crop = state.hw_crop;
+        restore_camera_settings(&state);
+        free(state.settings);
+        state.settings = strdup(settings);
+        set_camera_settings(&state, settings);
+        /* Restored and new values are set together */
+        apply_camera_controls();
+        /* Crop area is set on the driver: stream must be reconfigured */
+        if (had_hw_crop || ((crop[X_AXIS].enabled || crop[Y_AXIS].enabled) && !state.no_hw_crop)) {
+            return restart_stream();
         }
+    }
+    return 0;
+}
+
+static int restart_stream(void) {
+    stop_stream();
+    destroy_mmap();
+    reset_camera_crop();
+    set_camera_crop();
+    if (set_camera_fmt() == 0 && init_mmap() == 0 && start_stream() == 0) {
+        return 0;
+    }
+    return -1;
+}
+
+static void set_session_timer(int timeout) {
+    struct itimerspec timerValue = {{0}};
+    timerValue.it_value.tv_sec = timeout / 1000;
+    timerValue.it_value.tv_nsec = 1000 * 1000 * (timeout % 1000); // ms
+    timerfd_settime(session_fd, 0, &timerValue, NULL);
+}
+
+static void destroy_session(void) {
+    if (state.streaming) {
         destroy_decoder();
         stop_stream();
         restore_camera_settings(&state);
+        apply_camera_controls();
+        if (session_fd != -1) {
+            set_session_timer(0);
+        }
     }
     destroy_mmap();
-    return ctr;
+    if (state.device_fd >= 0) {
+        reset_camera_crop();
+        close(state.device_fd);
+    }
+    free(state.devnode);
+    free(state.settings);
+    /* reset state */
+    memset(&state, 0, sizeof(struct state));
+    state.device_fd = -1;
+}
+
+static struct ctrl_info *find_ctrl(uint32_t id) {
+    for (int i = 0; i < state.ctrls->num; i++) {
+        if (state.ctrls->ctrls[i].id == id) {
+            return &state.ctrls->ctrls[i];
+        }
+    }
+    return NULL;
+}
+
+/* Value the control will have after next apply_camera_controls() */
+static struct v4l2_ext_control *find_pending(uint32_t id) {
+    for (int i = 0; i < state.num_pending; i++) {
+        if (state.pending[i].id == id) {
+            return &state.pending[i];
+        }
+    }
+    return NULL;
+}
+
+static void load_camera_controls(void) {
+    if (!ctrl_caches) {
+        ctrl_caches = map_new(true, free);
+    }
+    
+    state.ctrls = map_get(ctrl_caches, state.devnode);
+    if (!state.ctrls) {
+        struct ctrl_cache *cache = calloc(1, sizeof(struct ctrl_cache));
+        if (!cache) {
+            perror("calloc");
+            return;
+        }
+        struct v4l2_query_ext_ctrl q = { .id = V4L2_CTRL_FLAG_NEXT_CTRL };
+        while (cache->num < CAMERA_MAX_CTRLS && xioctl(VIDIOC_QUERY_EXT_CTRL, &q) == 0) {
+            /* Only cache plain, readable, 32bit controls, as they are read back through .value */
+            if (!(q.flags & (V4L2_CTRL_FLAG_DISABLED | V4L2_CTRL_FLAG_WRITE_ONLY)) && q.elems == 1 && 
+                (q.type == V4L2_CTRL_TYPE_INTEGER || q.type == V4L2_CTRL_TYPE_BOOLEAN || 
+                 q.type == V4L2_CTRL_TYPE_MENU || q.type == V4L2_CTRL_TYPE_INTEGER_MENU)) {
+                
+                cache->ctrls[cache->num].id = q.id;
+                cache->ctrls[cache->num].def = q.default_value;
+                cache->num++;
+            }
+            q.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
+        }
+        INFO("Cached %d controls for '%s'.\n", cache->num, state.devnode);
+        map_put(ctrl_caches, state.devnode, cache);
+        state.ctrls = cache;
+    }
+    
+    /* Refresh current values, as they may have been changed by anyone else */
+    struct v4l2_ext_control ctrls[CAMERA_MAX_CTRLS] = {0};
+    for (int i = 0; i < state.ctrls->num; i++) {
+        ctrls[i].id = state.ctrls->ctrls[i].id;
+    }
+    struct v4l2_ext_controls ext = { .which = V4L2_CTRL_WHICH_CUR_VAL, .count = state.ctrls->num, .controls = ctrls };
+    if (state.ctrls->num == 0 || -1 == xioctl(VIDIOC_G_EXT_CTRLS, &ext)) {
+        INFO("Failed to load controls; using single controls.\n");
+        state.ctrls = NULL;
+        return;
+    }
+    for (int i = 0; i < state.ctrls->num; i++) {
+        state.ctrls->ctrls[i].cur = ctrls[i].value;
+    }
+}
+
+static void forget_camera_controls(const char *devnode) {
+    if (ctrl_caches) {
+        map_remove(ctrl_caches, devnode);
+    }
+}
+
+/* Set all pending controls at once, falling back to setting them one by one */
+static void apply_camera_controls(void) {
+    if (state.num_pending == 0) {
+        return;
+    }
+    
+    struct v4l2_ext_controls ext = { .which = V4L2_CTRL_WHICH_CUR_VAL, .count = state.num_pending, .controls = state.pending };
+    if (xioctl(VIDIOC_S_EXT_CTRLS, &ext) == 0) {
+        for (int i = 0; i < state.num_pending; i++) {
+            find_ctrl(state.pending[i].id)->cur = state.pending[i].value;
+        }
+    } else {
+        INFO("Failed to set controls at once; setting them one by one.\n");
+        for (int i = 0; i < state.num_pending; i++) {
+            struct v4l2_control ctrl = { .id = state.pending[i].id, .value = state.pending[i].value };
+            if (xioctl(VIDIOC_S_CTRL, &ctrl) == 0) {
+                find_ctrl(ctrl.id)->cur = ctrl.value;
+            } else {
+                INFO("Failed to set %u control.\n", ctrl.id);
+            }
+        }
+    }
+    state.num_pending = 0;
+}
+
+static struct v4l2_control *queue_camera_setting(uint32_t id, int32_t v, const char *name, bool store) {
+    struct ctrl_info *info = find_ctrl(id);
+    if (!info) {
+        INFO("'%s' unsupported\n", name);
+        return NULL;
+    }
+    
+    if (v < 0) {
+        /* Set default value */
+        INFO("%s (%u) default val: %d\n", name, id, info->def);
+        v = info->def;
+    }
+    
+    struct v4l2_ext_control *pending = find_pending(id);
+    const int32_t old_val = pending ? pending->value : info->cur;
+    if (old_val == v) {
+        INFO("Value %d for '%s' already set.\n", v, name);
+        return NULL;
+    }
+    
+    if (!pending) {
+        pending = &state.pending[state.num_pending++];
+        pending->id = id;
+    }
+    pending->value = v;
+    INFO("Queued '%s' val: %d\n", name, v);
+    if (store) {
+        struct v4l2_control *store_ctrl = calloc(1, sizeof(struct v4l2_control));
+        if (store_ctrl) {
+            store_ctrl->id = id;
+            store_ctrl->value = old_val;
+            INFO("Storing initial setting for '%s': %d\n", name, old_val);
+            return store_ctrl;
+        } else {
+            INFO("failed to store initial setting for '%s'\n", name)
+        }
+    }
+    return NULL;
 }
 
 static struct v4l2_control *set_camera_setting(void *priv, uint32_t id, float val, const char *name, bool store) {
+    if (state.ctrls) {
+        /* Controls are cached: they will be set by apply_camera_controls() */
+        return queue_camera_setting(id, (int32_t)val, name, store);
+    }
+    
     struct v4l2_control old_ctrl = {0};
     old_ctrl.id = id;
     int32_t v = (int32_t)val;
@@ -168,11 +559,58 @@ static struct v4l2_control *set_camera_setting(void *priv, uint32_t id, float va
     return NULL;
 }
 
+/* Push crop area down to the driver, so that it only delivers (and we only receive) the region of interest */
+static void set_camera_crop(void) {
+    if ((!crop[X_AXIS].enabled && !crop[Y_AXIS].enabled) || state.no_hw_crop) {
+        return;
+    }
+    
+    struct v4l2_selection sel = { .type = V4L2_BUF_TYPE_VIDEO_CAPTURE, .target = V4L2_SEL_TGT_CROP_BOUNDS };
+    if (-1 == xioctl(VIDIOC_G_SELECTION, &sel)) {
+        INFO("Crop selection unsupported; cropping frames.\n");
+        state.no_hw_crop = true;
+        return;
+    }
+    
+    const struct v4l2_rect bounds = sel.r;
+    sel.target = V4L2_SEL_TGT_CROP;
+    if (crop[X_AXIS].enabled) {
+        sel.r.left = bounds.left + crop[X_AXIS].area_pct[0] * bounds.width;
+        sel.r.width = (crop[X_AXIS].area_pct[1] - crop[X_AXIS].area_pct[0]) * bounds.width;
+    }
+    if (crop[Y_AXIS].enabled) {
+        sel.r.top = bounds.top + crop[Y_AXIS].area_pct[0] * bounds.height;
+        sel.r.height = (crop[Y_AXIS].area_pct[1] - crop[Y_AXIS].area_pct[0]) * bounds.height;
+    }
+    if (-1 == xioctl(VIDIOC_S_SELECTION, &sel)) {
+        INFO("Failed to set crop selection; cropping frames.\n");
+        state.no_hw_crop = true;
+        return;
+    }
+    
+    INFO("Driver crop: %u x %u at (%d, %d)\n", sel.r.width, sel.r.height, sel.r.left, sel.r.top);
+    state.hw_crop = true;
+    /* Frames only contain region of interest: do not crop them again */
+    crop[X_AXIS].enabled = false;
+    crop[Y_AXIS].enabled = false;
+}
+
+static void reset_camera_crop(void) {
+    if (state.hw_crop) {
+        struct v4l2_selection sel = { .type = V4L2_BUF_TYPE_VIDEO_CAPTURE, .target = V4L2_SEL_TGT_CROP_DEFAULT };
+        if (xioctl(VIDIOC_G_SELECTION, &sel) == 0) {
+            sel.target = V4L2_SEL_TGT_CROP;
+            xioctl(VIDIOC_S_SELECTION, &sel);
+        }
+        state.hw_crop = false;
+    }
+}
+
 static int set_camera_fmt(void) {
     struct v4l2_format fmt = {0};
     fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    fmt.fmt.pix.width = 160;
-    fmt.fmt.pix.height = 120;
+    fmt.fmt.pix.width = CAMERA_WIDTH;
+    fmt.fmt.pix.height = CAMERA_HEIGHT;
     fmt.fmt.pix.field = V4L2_FIELD_INTERLACED;
     fmt.fmt.pix.pixelformat = state.pixelformat;
     
@@ -185,6 +623,10 @@ static int set_camera_fmt(void) {
     INFO("Image res: %d x %d\n", fmt.fmt.pix.width, fmt.fmt.pix.height);
     state.height = fmt.fmt.pix.height;
     state.width = fmt.fmt.pix.width;
+    state.stride = fmt.fmt.pix.bytesperline;
+    if (state.stride == 0) {
+        state.stride = state.width * (1 + (state.pixelformat == V4L2_PIX_FMT_YUYV));
+    }
     return 0;
 }
 
@@ -229,7 +671,7 @@ static int check_camera_caps(void) {
 
 static void create_decoder(void) {
     if (state.pixelformat == V4L2_PIX_FMT_MJPEG) {
-        state.decoder = malloc(sizeof(*state.decoder));
+        state.decoder = calloc(1, sizeof(*state.decoder));
         state.decoder->cinfo.err = jpeg_std_error(&state.decoder->err);
         jpeg_create_decompress(&state.decoder->cinfo);
         state.decoder->dec_cb = mjpeg_to_gray;
@@ -237,34 +679,99 @@ static void create_decoder(void) {
 }
 
 static int mjpeg_to_gray(uint8_t **img_data, int size) {
+    struct jpeg_decompress_struct *cinfo = &state.decoder->cinfo;
+    
      /* Decompress jpeg and convert to grayscale through libjpeg */
-    jpeg_mem_src(&state.decoder->cinfo, *img_data, size);
-    int rc = jpeg_read_header(&state.decoder->cinfo, TRUE);
-    if (rc != 1) {
+    jpeg_mem_src(cinfo, *img_data, size);
+    int rc = jpeg_read_header(cinfo, TRUE);
+    if (rc != JPEG_HEADER_OK) {
         INFO("File does not seem to be a normal JPEG");
-        return 0;
+        return -EINVAL;
     }
         
     /* Convert from RGB to grayscale */
-    state.decoder->cinfo.out_color_space = JCS_GRAYSCALE;
+    cinfo->out_color_space = JCS_GRAYSCALE;
+    
+    /*
+     * We only need a luminance histogram:
+     * let libjpeg downscale in DCT domain, as long as
+     * resulting frame is not smaller than requested resolution.
+     * Many cameras just ignore the resolution we ask for.
+     */
+    cinfo->scale_num = 1;
+    cinfo->scale_denom = 1;
+    while (cinfo->scale_denom < 8 && 
+           cinfo->image_width / (cinfo->scale_denom * 2) >= CAMERA_WIDTH &&
+           cinfo->image_height / (cinfo->scale_denom * 2) >= CAMERA_HEIGHT) {
+        cinfo->scale_denom *= 2;
+    }
+    cinfo->dct_method = JDCT_IFAST;
+    cinfo->do_fancy_upsampling = FALSE;
         
-    jpeg_start_decompress(&state.decoder->cinfo);
-    const int width = state.decoder->cinfo.output_width;
-    const int height = state.decoder->cinfo.output_height;
-    const int pixel_size = state.decoder->cinfo.output_components;
+    jpeg_start_decompress(cinfo);
+    const int width = cinfo->output_width;
+    const int height = cinfo->output_height;
+    const int pixel_size = cinfo->output_components;
     const int row_stride = width * pixel_size;
     const int bmp_size = row_stride * height;
     
-    *img_data = malloc(bmp_size);
-    if (*img_data) {
-        while (state.decoder->cinfo.output_scanline < height) {
-            unsigned char *buffer_array = *img_data + state.decoder->cinfo.output_scanline * row_stride;
-            jpeg_read_scanlines(&state.decoder->cinfo, &buffer_array, 1);
+    /* Only (re)allocate when a frame does not fit in current scratch buffer */
+    if (bmp_size > state.decoder->scratch_size) {
+        uint8_t *scratch = realloc(state.decoder->scratch, bmp_size);
+        if (!scratch) {
+            jpeg_abort_decompress(cinfo);
+            return -ENOMEM;
+        }
+        state.decoder->scratch = scratch;
+        state.decoder->scratch_size = bmp_size;
+    }
+    
+    /*
+     * Only decode the region of interest, when frames are cropped by us:
+     * decoded rows are stored at their position in the full frame,
+     * thus histogram computation is unaffected.
+     */
+    JDIMENSION xoffset = 0;
+    int last_row = height;
+#ifdef LIBJPEG_TURBO_VERSION
+    rect_info_t roi;
+    get_crop_rect(&(rect_info_t){ .row_end = height, .col_end = width }, &roi);
+    JDIMENSION roi_width = roi.col_end - roi.col_start;
+    if (roi_width > 0 && roi_width < width) {
+        /* Region gets widened to iMCU boundaries */
+        xoffset = roi.col_start;
+        jpeg_crop_scanline(cinfo, &xoffset, &roi_width);
+    }
+    if (roi.row_start > 0 && roi.row_start < height) {
+        jpeg_skip_scanlines(cinfo, roi.row_start);
+    }
+    if (roi.row_end < height) {
+        last_row = roi.row_end;
+    }
+    INFO("Decoding rows [%d-%d], cols [%u-%u]\n", roi.row_start, last_row, xoffset, xoffset + roi_width);
+#endif
+    
+    JSAMPROW rows[CAMERA_MAX_SCANLINES];
+    while (cinfo->output_scanline < last_row) {
+        int num_rows = 0;
+        while (num_rows < CAMERA_MAX_SCANLINES && cinfo->output_scanline + num_rows < last_row) {
+            rows[num_rows] = state.decoder->scratch + (cinfo->output_scanline + num_rows) * row_stride + xoffset * pixel_size;
+            num_rows++;
         }
-        jpeg_finish_decompress(&state.decoder->cinfo);
-        return bmp_size;
+        jpeg_read_scanlines(cinfo, rows, num_rows);
+    }
+    if (cinfo->output_scanline < height) {
+        /* Remaining rows are not needed */
+        jpeg_abort_decompress(cinfo);
+    } else {
+        jpeg_finish_decompress(cinfo);
     }
-    return -ENOMEM;
+    
+    INFO("Decoded res: %d x %d (1/%u scale)\n", width, height, cinfo->scale_denom);
+    state.decoder->width = width;
+    state.decoder->height = height;
+    *img_data = state.decoder->scratch;
+    return bmp_size;
 }
 
 static void destroy_decoder(void) {
@@ -272,13 +779,14 @@ static void destroy_decoder(void) {
         if (state.pixelformat == V4L2_PIX_FMT_MJPEG) {
             jpeg_destroy_decompress(&state.decoder->cinfo);
         }
+        free(state.decoder->scratch);
         free(state.decoder);
     }
 }
 
 static int init_mmap(void) {
     struct v4l2_requestbuffers req = {0};
-    req.count = 1;
+    req.count = CAMERA_NUM_BUFFERS;
     req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     req.memory = V4L2_MEMORY_MMAP;
     
@@ -287,32 +795,52 @@ static int init_mmap(void) {
         return -1;
     }
     
-    struct v4l2_buffer buf = {0};
-    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buf.memory = V4L2_MEMORY_MMAP;
-    if (-1 == xioctl(VIDIOC_QUERYBUF, &buf)) {
-        perror("Querying Buffer");
+    /* Driver may give us a different number of buffers */
+    if (req.count == 0) {
+        fprintf(stderr, "No buffers allocated.\n");
         return -1;
     }
-        
-    state.buf.start = mmap(NULL,
-                            buf.length,
-                            PROT_READ | PROT_WRITE,
-                            MAP_SHARED,
-                            state.device_fd, buf.m.offset);
-        
-    if (MAP_FAILED == state.buf.start) {
-        perror("mmap");
-        return -1;
+    if (req.count > CAMERA_NUM_BUFFERS) {
+        req.count = CAMERA_NUM_BUFFERS;
+    }
+    INFO("Using %u buffers.\n", req.count);
+    
+    for (uint32_t i = 0; i < req.count; i++) {
+        struct v4l2_buffer buf = {0};
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = i;
+        if (-1 == xioctl(VIDIOC_QUERYBUF, &buf)) {
+            perror("Querying Buffer");
+            return -1;
+        }
+            
+        state.bufs[i].start = mmap(NULL,
+                                   buf.length,
+                                   PROT_READ | PROT_WRITE,
+                                   MAP_SHARED,
+                                   state.device_fd, buf.m.offset);
+            
+        if (MAP_FAILED == state.bufs[i].start) {
+            perror("mmap");
+            return -1;
+        }
+        state.bufs[i].length = buf.length;
+        state.num_bufs++;
     }
-    state.buf.length = buf.length;
     return 0;
 }
 
 static void destroy_mmap(void) {
-    if (state.buf.length > 0) {
-        munmap(state.buf.start, state.buf.length);
+    for (uint32_t i = 0; i < state.num_bufs; i++) {
+        munmap(state.bufs[i].start, state.bufs[i].length);
+    }
+    if (state.num_bufs > 0) {
+        /* Release driver buffers too, so that stream can be reconfigured */
+        struct v4l2_requestbuffers req = { .count = 0, .type = V4L2_BUF_TYPE_VIDEO_CAPTURE, .memory = V4L2_MEMORY_MMAP };
+        xioctl(VIDIOC_REQBUFS, &req);
     }
+    state.num_bufs = 0;
 }
 
 static int xioctl(int request, void *arg) {
@@ -359,25 +887,38 @@ static int recv_frame(struct v4l2_buffer *buf) {
     return 0;
 }
 
-static double compute_brightness(unsigned int size) {
+static double compute_brightness(uint32_t index, unsigned int size) {
     double brightness = 0.0;
-    uint8_t *img_data = state.buf.start;
-    if (state.decoder) {
-        size = state.decoder->dec_cb(&img_data, size);
-        if (size < 0) {
-            return brightness;
-        }
-    }
-    
+    uint8_t *img_data = state.bufs[index].start;
     rect_info_t full = {
         .row_start = 0,
         .row_end = state.height,
         .col_start = 0,
         .col_end = state.width,
     };
-    brightness = get_frame_brightness(img_data, &full, (state.pixelformat == V4L2_PIX_FMT_YUYV));
-    if (img_data != state.buf.start) {
-        free(img_data);
+    int stride = state.stride;
+    
+    if (state.decoder) {
+        STAGE_START(decode);
+        if (state.decoder->dec_cb(&img_data, size) < 0) {
+            return brightness;
+        }
+        STAGE_END(decode);
+        /* Decoder may have downscaled the frame */
+        full.row_end = state.decoder->height;
+        full.col_end = state.decoder->width;
+        stride = state.decoder->width;
     }
+    STAGE_START(histogram);
+    brightness = get_frame_brightness(img_data, &full, stride, (state.pixelformat == V4L2_PIX_FMT_YUYV));
+    STAGE_END(histogram);
     return brightness;
 }
+
+/* Frames are timestamped by the driver when captured, not when dequeued by us */
+static uint64_t frame_timestamp(const struct v4l2_buffer *buf) {
+    if ((buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+        return (uint64_t)buf->timestamp.tv_sec * 1000000 + buf->timestamp.tv_usec;
+    }
+    return sensor_now_usec();
+}
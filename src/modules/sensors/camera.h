@@ -12,6 +12,7 @@
 
 #define CAMERA_ILL_MAX              255
 #define HISTOGRAM_STEPS             40
+#define HISTOGRAM_LANES             4
 
 #define SET_V4L2(op, val) \
 do { \
@@ -46,10 +47,57 @@ static map_t *stored_values;
 static crop_info_t crop[MAX_AXIS];
 static bool camera_set;
 
-static double get_frame_brightness(uint8_t *img_data, rect_info_t *full, bool is_yuv) {
+/*
+ * Accumulate a row of pixels into interleaved 256-bins histograms.
+ * Interleaving avoids stalls when consecutive pixels hit the same bin.
+ * If YUYV, only luma (even) bytes are accumulated.
+ * 
+ * Cost is bound by bins increments, that SSE2/AVX2/NEON cannot vectorize (they lack conflict-free scatters):
+ * deinterleaving YUYV luma through vector registers, then reading it back, 
+ * was measured to be slower than plain strided loads (see bench/histogram_bench.c).
+ */
+static inline void histogram_row(uint32_t lanes[HISTOGRAM_LANES][CAMERA_ILL_MAX + 1], 
+                                 const uint8_t *row, const int len, const bool is_yuv) {
+    int i = 0;
+    if (is_yuv) {
+        for (; i + HISTOGRAM_LANES <= len; i += HISTOGRAM_LANES) {
+            lanes[0][row[2 * i]]++;
+            lanes[1][row[2 * i + 2]]++;
+            lanes[2][row[2 * i + 4]]++;
+            lanes[3][row[2 * i + 6]]++;
+        }
+        for (; i < len; i++) {
+            lanes[0][row[2 * i]]++;
+        }
+    } else {
+        for (; i + HISTOGRAM_LANES <= len; i += HISTOGRAM_LANES) {
+            lanes[0][row[i]]++;
+            lanes[1][row[i + 1]]++;
+            lanes[2][row[i + 2]]++;
+            lanes[3][row[i + 3]]++;
+        }
+        for (; i < len; i++) {
+            lanes[0][row[i]]++;
+        }
+    }
+}
+
+/* Compute region of interest of a frame, given crop settings */
+static inline void get_crop_rect(const rect_info_t *full, rect_info_t *crop_rect) {
+    *crop_rect = *full;
+    if (crop[X_AXIS].enabled) {
+        crop_rect->col_start = crop[X_AXIS].area_pct[0] * full->col_end;
+        crop_rect->col_end = crop[X_AXIS].area_pct[1] * full->col_end;
+    }
+    if (crop[Y_AXIS].enabled) {
+        crop_rect->row_start = crop[Y_AXIS].area_pct[0] * full->row_end;
+        crop_rect->row_end = crop[Y_AXIS].area_pct[1] * full->row_end;
+    }
+}
+
+/* Stride is the length in bytes of each row of img_data, including any padding */
+static double get_frame_brightness(uint8_t *img_data, rect_info_t *full, int stride, bool is_yuv) {
     double brightness = 0.0;
-    double min = CAMERA_ILL_MAX;
-    double max = 0.0;
     
     /*
      * If greyscale (rgb is converted to grey) -> increment by 1. 
@@ -57,49 +105,55 @@ static double get_frame_brightness(uint8_t *img_data, rect_info_t *full, bool is
      */
     const int inc = 1 + is_yuv;
     
-    rect_info_t crop_rect = *full;
-    if (crop[X_AXIS].enabled) {
-        crop_rect.col_start = crop[X_AXIS].area_pct[0] * full->col_end;
-        crop_rect.col_end = crop[X_AXIS].area_pct[1] * full->col_end;
-    }
-    if (crop[Y_AXIS].enabled) {
-        crop_rect.row_start = crop[Y_AXIS].area_pct[0] * full->row_end;
-        crop_rect.row_end = crop[Y_AXIS].area_pct[1] * full->row_end;
-    }
+    rect_info_t crop_rect;
+    get_crop_rect(full, &crop_rect);
     INFO("Rect: rows[%d-%d], cols[%d-%d]\n", crop_rect.row_start, crop_rect.row_end, 
                                                         crop_rect.col_start, crop_rect.col_end);
     
-    /* Find minimum and maximum brightness */
+    /* Single pass over the frame: build a 256-bins luma histogram */
+    uint32_t lanes[HISTOGRAM_LANES][CAMERA_ILL_MAX + 1] = {{0}};
+    const int row_len = crop_rect.col_end - crop_rect.col_start;
+    for (int row = crop_rect.row_start; row < crop_rect.row_end && row_len > 0; row++) {
+        const uint8_t *row_data = img_data + (size_t)row * stride + crop_rect.col_start * inc;
+        histogram_row(lanes, row_data, row_len, is_yuv);
+    }
+    
+    /* Merge lanes, and find minimum and maximum brightness */
+    uint32_t bins[CAMERA_ILL_MAX + 1];
+    int min = -1;
+    int max = 0;
     int total = 0; // compute total used pixels
-    for (int row = crop_rect.row_start; row < crop_rect.row_end; row++) {
-        for (int col = crop_rect.col_start * inc; col < crop_rect.col_end * inc; col += inc) {
-            const int idx = (row * full->col_end * inc) + col;
-            if (img_data[idx] < min) {
-                min = img_data[idx];
-            }
-            if (img_data[idx] > max) {
-                max = img_data[idx];
+    for (int v = 0; v <= CAMERA_ILL_MAX; v++) {
+        bins[v] = lanes[0][v] + lanes[1][v] + lanes[2][v] + lanes[3][v];
+        if (bins[v] > 0) {
+            if (min == -1) {
+                min = v;
             }
-            total++;
+            max = v;
+            total += bins[v];
         }
     }
     INFO("Total computed pixels: %d\n", total);
     
     /* Ok, we should never get in here */
-    if (max == 0.0) {
+    if (max == 0) {
         return brightness;
     }
     
-    /* Calculate histogram */
+    /* Uniform frame */
+    if (min == max) {
+        return (double)max / CAMERA_ILL_MAX;
+    }
+    
+    /* Calculate histogram steps from luma bins */
     struct histogram hist[HISTOGRAM_STEPS] = {0};
-    const double step_size = (max - min) / HISTOGRAM_STEPS;
-    for (int row = crop_rect.row_start; row < crop_rect.row_end; row++) {
-        for (int col = crop_rect.col_start * inc; col < crop_rect.col_end * inc; col += inc) {
-            const int idx = (row * full->col_end * inc) + col;
-            int bucket = (img_data[idx] - min) / step_size;
-            if (bucket >= 0 && bucket < HISTOGRAM_STEPS) {
-                hist[bucket].sum += img_data[idx];
-                hist[bucket].count++;
+    const double step_size = (double)(max - min) / HISTOGRAM_STEPS;
+    for (int v = min; v <= max; v++) {
+        if (bins[v] > 0) {
+            int bucket = (v - min) / step_size;
+            if (bucket < HISTOGRAM_STEPS) {
+                hist[bucket].sum += (double)v * bins[v];
+                hist[bucket].count += bins[v];
             }
         }
     }
@@ -176,7 +230,10 @@ static void set_camera_settings(void *priv, char *settings) {
     crop[X_AXIS].area_pct[1] = 1.0;
     crop[Y_AXIS].area_pct[1] = 1.0;
     
-    stored_values = map_new(true, free);
+    /* Map is kept around and just cleared by restore_camera_settings() */
+    if (!stored_values) {
+        stored_values = map_new(true, free);
+    }
     
     /* Set default values */
     set_camera_settings_def(priv);
@@ -230,8 +287,7 @@ static void restore_camera_settings(void *priv) {
         set_camera_setting(priv, old_ctrl->id, old_ctrl->value, ctrl_name, false);
     }
     
-    map_free(stored_values);
-    stored_values = NULL;
+    map_clear(stored_values);
     
     memset(crop, 0, sizeof(crop));
     camera_set = false;
@@ -1,19 +1,49 @@
 #include <sensor.h>
 #include <sys/inotify.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include <poll.h>
 #include <glob.h>
 #include <limits.h>
+#include <module/map.h>
 
 #define CUSTOM_NAME         "Custom"
 #define CUSTOM_ILL_MAX      4096
 #define CUSTOM_ILL_MIN      0
 #define CUSTOM_INTERVAL     20 // ms
 #define CUSTOM_FLD          "/etc/clightd/sensors.d/"
+#define CUSTOM_MAX_FILES    16 // held files; least recently captured one is closed to make room for a new one
 
 #define BUF_LEN (sizeof(struct inotify_event) + NAME_MAX + 1)
+#define VAL_BUF_LEN         64
+
+/* 
+ * Up to CUSTOM_MAX_FILES custom sensor files are kept opened across captures,
+ * and only read again when they changed:
+ * - regular files are watched for IN_MODIFY, and dropped once unlinked or replaced;
+ * - FIFOs are drained without blocking, keeping any partially written value for next read;
+ * - sysfs attributes are either always read or, if requested through settings, 
+ *   only when POLLPRI is signaled (not all attributes support notifications).
+ */
+typedef struct {
+    int fd;
+    int wd;             // IN_MODIFY watch; -1 if file changes can't be watched
+    bool is_fifo;
+    bool is_sysfs;
+    bool stale;         // file changed since last read
+    bool has_val;
+    int val;            // last read value
+    char tail[VAL_BUF_LEN]; // FIFO data not yet terminated by a delimiter
+    size_t tail_len;
+    uint64_t last_used; // capture_ctr value of last capture
+} custom_file_t;
 
 SENSOR(CUSTOM_NAME);
 
 static int inot_fd, inot_wd;
+static int mod_fd = -1;     // inotify fd for IN_MODIFY watches of held files
+static map_t *files;        // path -> custom_file_t
+static uint64_t capture_ctr;
 
 static bool validate_dev(void *dev) {
     return true;
@@ -68,7 +98,18 @@ static void destroy_dev(void *dev) {
     free(dev);
 }
 
+static void file_dtor(void *data) {
+    custom_file_t *f = (custom_file_t *)data;
+    if (f->wd >= 0) {
+        inotify_rm_watch(mod_fd, f->wd);
+    }
+    close(f->fd);
+    free(f);
+}
+
 static int init_monitor(void) {
+    mod_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    files = map_new(true, file_dtor);
     inot_fd = inotify_init();
     inot_wd = inotify_add_watch(inot_fd, CUSTOM_FLD, IN_CREATE | IN_DELETE | IN_MOVE);
     return inot_fd;
@@ -86,6 +127,8 @@ static void recv_monitor(void **dev) {
             char fullpath[PATH_MAX + 1] = {0};
             snprintf(fullpath, PATH_MAX, CUSTOM_FLD"%s", event->name);
             *dev = strdup(fullpath);
+            /* File was created, removed or replaced: drop any fd held on it */
+            map_remove(files, fullpath);
         }
     }
 }
@@ -93,16 +136,19 @@ static void recv_monitor(void **dev) {
 static void destroy_monitor(void) {
     inotify_rm_watch(inot_fd, inot_wd);
     close(inot_fd);
+    map_free(files);
+    close(mod_fd);
 }
 
-static void parse_settings(char *settings, int *min, int *max, int *interval) {
-    const char opts[] = { 'i', 'm', 'M' };
-    int *vals[] = { interval, min, max };
+static void parse_settings(char *settings, int *min, int *max, int *interval, int *pri) {
+    const char opts[] = { 'i', 'm', 'M', 'p' };
+    int *vals[] = { interval, min, max, pri };
 
     /* Default values */
     *min = CUSTOM_ILL_MIN;
     *max = CUSTOM_ILL_MAX;
     *interval = CUSTOM_INTERVAL;
+    *pri = 0;
 
     if (settings && settings[0] != '\0') {
         char *token; 
@@ -150,27 +196,222 @@ static void parse_settings(char *settings, int *min, int *max, int *interval) {
     }
 }
 
-static int capture(void *dev, double *pct, const int num_captures, char *settings) {
-    int min, max, interval;
-    parse_settings(settings, &min, &max, &interval);
+/* File was unlinked or replaced (eg: by an atomic mv) while we held it */
+static bool file_unlinked(const custom_file_t *f) {
+    struct stat st;
+    return fstat(f->fd, &st) == 0 && st.st_nlink == 0;
+}
+
+/* Close least recently captured file */
+static void evict_file(void) {
+    char *oldest = NULL;
+    uint64_t last_used = UINT64_MAX;
+    for (map_itr_t *itr = map_itr_new(files); itr; itr = map_itr_next(itr)) {
+        custom_file_t *f = map_itr_get_data(itr);
+        if (f->last_used < last_used) {
+            last_used = f->last_used;
+            free(oldest);
+            oldest = strdup(map_itr_get_key(itr));
+        }
+    }
+    if (oldest) {
+        map_remove(files, oldest);
+        free(oldest);
+    }
+}
+
+static custom_file_t *get_file(const char *path) {
+    custom_file_t *f = map_get(files, path);
+    if (f && f->is_fifo && file_unlinked(f)) {
+        /* FIFOs are not watched: check they still are the one at path */
+        map_remove(files, path);
+        f = NULL;
+    }
+    if (!f) {
+        int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) {
+            return NULL;
+        }
+        f = calloc(1, sizeof(custom_file_t));
+        if (!f) {
+            close(fd);
+            return NULL;
+        }
+        if (map_length(files) >= CUSTOM_MAX_FILES) {
+            evict_file();
+        }
+        f->fd = fd;
+        f->wd = -1;
+        f->stale = true;
+        
+        struct stat st;
+        struct statfs sfs;
+        f->is_fifo = fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+        f->is_sysfs = fstatfs(fd, &sfs) == 0 && (sfs.f_type == SYSFS_MAGIC || sfs.f_type == PROC_SUPER_MAGIC);
+        if (!f->is_fifo && !f->is_sysfs) {
+            /* IN_ATTRIB is notified when link count drops, as IN_DELETE_SELF only comes after we close the fd */
+            f->wd = inotify_add_watch(mod_fd, path, IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+        }
+        map_put(files, path, f);
+    }
+    f->last_used = capture_ctr++;
+    return f;
+}
+
+/* Consume pending inotify events for held files, without blocking */
+static void drain_modifications(void) {
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(mod_fd, buffer, sizeof(buffer))) > 0) {
+        for (char *ptr = buffer; ptr < buffer + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event *)ptr)->len) {
+            const struct inotify_event *event = (const struct inotify_event *)ptr;
+            char *gone = NULL;
+            for (map_itr_t *itr = map_itr_new(files); itr; itr = map_itr_next(itr)) {
+                custom_file_t *f = map_itr_get_data(itr);
+                if (f->wd == event->wd) {
+                    if (event->mask & IN_MODIFY) {
+                        f->stale = true;
+                    }
+                    if ((event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) || 
+                        ((event->mask & IN_ATTRIB) && file_unlinked(f))) {
+                        gone = strdup(map_itr_get_key(itr));
+                    }
+                    free(itr);
+                    break;
+                }
+            }
+            if (gone) {
+                /* Held fd points to a stale inode: reopen file on next capture */
+                map_remove(files, gone);
+                free(gone);
+            }
+        }
+    }
+}
+
+/* Parse a base 10 integer, skipping leading whitespaces. Returns NULL on failure. */
+static const char *parse_int(const char *str, int *val) {
+    while (*str == ' ' || *str == '\t' || *str == '\n' || *str == '\r') {
+        str++;
+    }
+    const bool neg = *str == '-';
+    if (*str == '-' || *str == '+') {
+        str++;
+    }
+    if (*str < '0' || *str > '9') {
+        return NULL;
+    }
+    int v = 0;
+    for (; *str >= '0' && *str <= '9'; str++) {
+        const int digit = *str - '0';
+        /* Clamp out of range values */
+        v = v > (INT_MAX - digit) / 10 ? INT_MAX : v * 10 + digit;
+    }
+    *val = neg ? -v : v;
+    return str;
+}
+
+static inline bool is_delim(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/* Parse all values in str, storing the last one. */
+static bool parse_last_int(const char *str, int *val) {
+    bool found = false;
+    while ((str = parse_int(str, val))) {
+        found = true;
+    }
+    return found;
+}
+
+static bool read_value(custom_file_t *f, int *val) {
+    char buf[2 * VAL_BUF_LEN];
+    ssize_t len;
+    if (!f->is_fifo) {
+        len = pread(f->fd, buf, VAL_BUF_LEN - 1, 0);
+        if (len <= 0) {
+            return false;
+        }
+        buf[len] = '\0';
+        return parse_int(buf, val) != NULL;
+    }
+    
+    /* 
+     * Only keep latest value written to the FIFO.
+     * A value may be split across reads: only parse up to last delimiter, 
+     * and prepend the remainder to next read.
+     */
+    bool found = false;
+    memcpy(buf, f->tail, f->tail_len);
+    while ((len = read(f->fd, buf + f->tail_len, sizeof(buf) - 1 - f->tail_len)) > 0) {
+        len += f->tail_len;
+        ssize_t end = len;
+        while (end > 0 && !is_delim(buf[end - 1])) {
+            end--;
+        }
+        buf[len] = '\0';
+        f->tail_len = len - end;
+        if (f->tail_len >= VAL_BUF_LEN) {
+            /* Not a value: drop it */
+            f->tail_len = 0;
+        }
+        memcpy(f->tail, buf + end, f->tail_len);
+        buf[end] = '\0';
+        found |= parse_last_int(buf, val);
+        memcpy(buf, f->tail, f->tail_len);
+    }
+    if (len == 0 && f->tail_len > 0) {
+        /* No writers left: remainder is a complete value */
+        buf[f->tail_len] = '\0';
+        f->tail_len = 0;
+        found |= parse_last_int(buf, val);
+    }
+    return found;
+}
+
+static bool file_changed(custom_file_t *f, bool pri) {
+    if (f->stale || f->is_fifo || f->wd == -1) {
+        if (f->is_sysfs && pri && f->has_val) {
+            struct pollfd pfd = { .fd = f->fd, .events = POLLPRI };
+            return poll(&pfd, 1, 0) > 0;
+        }
+        return true;
+    }
+    return false;
+}
+
+static int capture(void *dev, double *pct, uint64_t *ts, const int num_captures, char *settings) {
+    int min, max, interval, pri;
+    parse_settings(settings, &min, &max, &interval, &pri);
 
     int ctr = 0;
-    FILE *fdev = fopen(dev, "r");
-    if (fdev) {
+    drain_modifications();
+    custom_file_t *f = get_file(dev);
+    if (f) {
         for (int i = 0; i < num_captures; i++) {
-            int ill = -1;
-            if (fscanf(fdev, "%d", &ill) == 1) {
+            int ill;
+            if (file_changed(f, pri) && read_value(f, &ill)) {
+                f->val = ill;
+                f->has_val = true;
+                f->stale = false;
+            }
+            if (f->has_val) {
+                ill = f->val;
                 if (ill > max) {
                     ill = max;
                 } else if (ill < min) {
                     ill = min;
                 }
+                ts[ctr] = sensor_now_usec();
                 pct[ctr++] = (double)ill / max;
-                rewind(fdev);
             }
-            usleep(interval * 1000);
         }
     }
-    fclose(fdev);
     return ctr;
 }
+
+static int capture_interval(void *dev, char *settings) {
+    int min, max, interval, pri;
+    parse_settings(settings, &min, &max, &interval, &pri);
+    return interval;
+}
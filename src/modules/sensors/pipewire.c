@@ -3,13 +3,15 @@
 #warning "Experimental support. Camera settings are not supported."
 
 #include "camera.h"
-#include "bus_utils.h"
 #include <spa/param/video/format-utils.h>
 #include <spa/debug/types.h>
 #include <spa/utils/result.h>
 #include <pipewire/pipewire.h>
 #include <sys/eventfd.h>
 #include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/dma-buf.h>
 
 #define EVENT_SIZE  ( sizeof (struct inotify_event) )
 #define EVENT_BUF_LEN     ( 1024 * ( EVENT_SIZE + 16 ) )
@@ -28,19 +30,34 @@ typedef struct {
 
 typedef struct {
     double *pct;
+    uint64_t *ts;
+    int num_captures;
     int capture_idx;
     bool with_err;
     char *settings;
 } capture_settings_t;
 
+/* 
+ * Each node keeps its stream on monitor core for its whole lifetime:
+ * it is only activated during captures and paused in between,
+ * so that format negotiation and buffers allocation happen just once.
+ */
 typedef struct {
     pw_node_t node;
-    struct pw_loop *loop;
     struct pw_stream *stream;
+    struct spa_hook stream_listener;
     struct spa_video_info format;
     capture_settings_t cap_set;
 } pw_data_t;
 
+/* Luma area of a MemFd/DmaBuf buffer, mmapped on first use and remapped when chunk moves */
+typedef struct {
+    void *base;
+    size_t len;
+    size_t offset;              // offset of chunk data from base
+    uint32_t chunk_offset;      // chunk offset the buffer was mapped for
+} pw_map_t;
+
 typedef struct {
     struct pw_loop *loop;
     struct pw_context *context;
@@ -50,6 +67,7 @@ typedef struct {
 } pw_mon_t;
 
 static void free_node(void *dev);
+static void destroy_stream(pw_data_t *pw);
 static void build_format(struct spa_pod_builder *b, const struct spa_pod **params);
 static uint32_t control_to_prop_id(uint32_t control_id);
 static int register_monitor_fd(const char *pw_runtime_dir);
@@ -116,6 +134,7 @@ static void free_node(void *dev) {
     pw_data_t *pw = (pw_data_t *)dev;
     pw->node.action = NULL; // see destroy_dev() impl
     destroy_dev(pw);
+    destroy_stream(pw);
     pw_proxy_destroy(pw->node.proxy);
     free((void *)pw->node.objpath);
     free(pw);
@@ -133,6 +152,69 @@ static void on_state_changed(void *_data, enum pw_stream_state old,
     }
 }
 
+static void unmap_luma(struct pw_buffer *b) {
+    pw_map_t *map = b->user_data;
+    if (map) {
+        munmap(map->base, map->len);
+        free(map);
+        b->user_data = NULL;
+    }
+}
+
+/* 
+ * Return a pointer to first luma_len bytes of frame data,
+ * mapping (only) them for MemFd/DmaBuf buffers.
+ * Frames whose buffer is too small to hold luma_len bytes are rejected.
+ */
+static uint8_t *map_luma(struct pw_buffer *b, size_t luma_len) {
+    struct spa_data *d = &b->buffer->datas[0];
+    if (d->chunk->offset > d->maxsize || d->maxsize - d->chunk->offset < luma_len) {
+        fprintf(stderr, "Frame does not fit buffer: %u bytes available, %zu needed.\n", 
+                d->chunk->offset > d->maxsize ? 0 : d->maxsize - d->chunk->offset, luma_len);
+        return NULL;
+    }
+    if (d->type == SPA_DATA_MemPtr) {
+        return d->data ? (uint8_t *)d->data + d->chunk->offset : NULL;
+    }
+    if (d->type != SPA_DATA_MemFd && d->type != SPA_DATA_DmaBuf) {
+        return NULL;
+    }
+    
+    pw_map_t *map = b->user_data;
+    if (map && map->chunk_offset != d->chunk->offset) {
+        unmap_luma(b);
+        map = NULL;
+    }
+    if (!map) {
+        map = calloc(1, sizeof(pw_map_t));
+        if (!map) {
+            return NULL;
+        }
+        /* mmap offset must be page aligned */
+        const size_t page_size = sysconf(_SC_PAGESIZE);
+        const size_t aligned = d->mapoffset & ~(page_size - 1);
+        map->offset = d->mapoffset - aligned + d->chunk->offset;
+        map->len = map->offset + luma_len;
+        map->chunk_offset = d->chunk->offset;
+        map->base = mmap(NULL, map->len, PROT_READ, MAP_SHARED, d->fd, aligned);
+        if (map->base == MAP_FAILED) {
+            fprintf(stderr, "Failed to mmap buffer: %m\n");
+            free(map);
+            return NULL;
+        }
+        b->user_data = map;
+    }
+    return (uint8_t *)map->base + map->offset;
+}
+
+static void dmabuf_sync(struct pw_buffer *b, uint64_t flags) {
+    struct spa_data *d = &b->buffer->datas[0];
+    if (d->type == SPA_DATA_DmaBuf) {
+        struct dma_buf_sync sync = { .flags = flags | DMA_BUF_SYNC_READ };
+        ioctl(d->fd, DMA_BUF_IOCTL_SYNC, &sync);
+    }
+}
+
 static void on_process(void *_data) {
     pw_data_t *pw = _data;
     
@@ -142,20 +224,39 @@ static void on_process(void *_data) {
         goto err;
     }
     
+    /* Frames still flowing after a capture ended, while stream is being paused */
+    if (pw->cap_set.capture_idx >= pw->cap_set.num_captures) {
+        pw_stream_queue_buffer(pw->stream, b);
+        return;
+    }
+    
+    /* 
+     * GRAY8, NV12 and I420 start with a full Y plane;
+     * for YUY2 luma is interleaved within the whole frame.
+     */
     const bool is_yuv = pw->format.info.raw.format == SPA_VIDEO_FORMAT_YUY2;
-    struct spa_buffer *buf = b->buffer;
-    uint8_t *sdata = buf->datas[0].data;
+    const int width = pw->format.info.raw.size.width;
+    const int height = pw->format.info.raw.size.height;
+    int stride = b->buffer->datas[0].chunk->stride;
+    if (stride <= 0) {
+        stride = width * (1 + is_yuv);
+    }
+    uint8_t *sdata = map_luma(b, (size_t)stride * height);
     if (sdata == NULL) {
+        pw_stream_queue_buffer(pw->stream, b);
         goto err;
     }
     
     rect_info_t full = {
         .row_start = 0,
-        .row_end = pw->format.info.raw.size.height,
+        .row_end = height,
         .col_start = 0,
-        .col_end = pw->format.info.raw.size.width,
+        .col_end = width,
     };
-    pw->cap_set.pct[pw->cap_set.capture_idx++] = get_frame_brightness(sdata, &full, is_yuv);
+    dmabuf_sync(b, DMA_BUF_SYNC_START);
+    pw->cap_set.ts[pw->cap_set.capture_idx] = sensor_now_usec();
+    pw->cap_set.pct[pw->cap_set.capture_idx++] = get_frame_brightness(sdata, &full, stride, is_yuv);
+    dmabuf_sync(b, DMA_BUF_SYNC_END);
     pw_stream_queue_buffer(pw->stream, b);
     return;
     
@@ -163,6 +264,10 @@ err:
     pw->cap_set.with_err = true;
 }
 
+static void on_remove_buffer(void *_data, struct pw_buffer *b) {
+    unmap_luma(b);
+}
+
 static void on_stream_param_changed(void *_data, uint32_t id, const struct spa_pod *param) {
     pw_data_t *pw = _data;
     
@@ -192,7 +297,9 @@ static void on_stream_param_changed(void *_data, uint32_t id, const struct spa_p
     struct spa_pod_builder b = SPA_POD_BUILDER_INIT(params_buffer, sizeof(params_buffer));
     const struct spa_pod *params = spa_pod_builder_add_object(&b,
                                          SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
-                                         SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int((1<<SPA_DATA_MemPtr)));
+                                         SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int((1<<SPA_DATA_MemPtr) | 
+                                                                                              (1<<SPA_DATA_MemFd) | 
+                                                                                              (1<<SPA_DATA_DmaBuf)));
     pw_stream_update_params(pw->stream, &params, 1);
     
     INFO("Image fmt: %d\n", pw->format.info.raw.format);
@@ -205,6 +312,7 @@ static const struct pw_stream_events stream_events = {
     .state_changed = on_state_changed,
     .param_changed = on_stream_param_changed,
     .process = on_process,
+    .remove_buffer = on_remove_buffer,
 };
 
 static void build_format(struct spa_pod_builder *b, const struct spa_pod **params) {
@@ -212,9 +320,12 @@ static void build_format(struct spa_pod_builder *b, const struct spa_pod **param
                                         SPA_TYPE_OBJECT_Format,     SPA_PARAM_EnumFormat,
                                         SPA_FORMAT_mediaType,       SPA_POD_Id(SPA_MEDIA_TYPE_video),
                                         SPA_FORMAT_mediaSubtype,    SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw),
-                                        SPA_FORMAT_VIDEO_format,    SPA_POD_CHOICE_ENUM_Id(2,
+                                        SPA_FORMAT_VIDEO_format,    SPA_POD_CHOICE_ENUM_Id(5,
+                                                                        SPA_VIDEO_FORMAT_GRAY8, // default
                                                                         SPA_VIDEO_FORMAT_GRAY8, // V4L2_PIX_FMT_GREY
-                                                                        SPA_VIDEO_FORMAT_YUY2), // V4L2_PIX_FMT_YUYV
+                                                                        SPA_VIDEO_FORMAT_YUY2,  // V4L2_PIX_FMT_YUYV
+                                                                        SPA_VIDEO_FORMAT_NV12,  // Y plane only is read
+                                                                        SPA_VIDEO_FORMAT_I420), // Y plane only is read
                                         SPA_FORMAT_VIDEO_size,      SPA_POD_CHOICE_RANGE_Rectangle(
                                                                         &SPA_RECTANGLE(160, 120),
                                                                         &SPA_RECTANGLE(1, 1),
@@ -239,7 +350,7 @@ static void fetch_dev(const char *interface, void **dev) {
         // This means that external webcam are always preferred to internal ones,
         // as they tend to have better resolution and increased image quality.
         struct udev_device *d = NULL;
-        get_udev_device(NULL, CAMERA_SUBSYSTEM, &(udev_match){.prop_key=CAMERA_CAPTURE_PROP_NAME, .prop_val=CAMERA_CAPTURE_PROP_VAL, .last_added = true}, NULL, &d);
+        get_udev_device(NULL, CAMERA_SUBSYSTEM, &(udev_match){.prop_key=CAMERA_CAPTURE_PROP_NAME, .prop_val=CAMERA_CAPTURE_PROP_VAL, .last_added = true, .cached = true}, NULL, &d);
         if (d) {
             const char *devnode = udev_device_get_devnode(d);
             // Peek first pw node found
@@ -267,14 +378,7 @@ static void fetch_props_dev(void *dev, const char **node, const char **action) {
 
 static void destroy_dev(void *dev) {
     pw_data_t *pw = (pw_data_t *)dev;
-    if (pw->stream) {
-        pw_stream_destroy(pw->stream);
-        pw->stream = NULL;
-    }
-    if (pw->loop) {
-        pw_loop_destroy(pw->loop);
-        pw->loop = NULL;
-    }
+    /* Stream is kept (paused) until node is removed */
     memset(&pw->cap_set, 0, sizeof(pw->cap_set));
     
     if (pw->node.action && !strcmp(pw->node.action, UDEV_ACTION_RM)) {
@@ -534,10 +638,10 @@ static void recv_monitor(void **dev) {
     uint64_t u;
     read(efd, &u, sizeof(uint64_t));
     
-    // Actually search for new nodes
-    last_recved = NULL;
+    // Actually search for new nodes; last_recved may also be set by a capture()
     pw_loop_iterate(pw_mon.loop, 0);
     *dev = last_recved;
+    last_recved = NULL;
 }
 
 static void destroy_monitor(void) {
@@ -572,56 +676,114 @@ static void on_timeout(void *userdata, uint64_t expirations) {
     pw->cap_set.with_err = true;
 }
 
-static int capture(void *dev, double *pct, const int num_captures, char *settings) {
-    pw_data_t *pw = (pw_data_t *)dev;
-    pw->cap_set.pct = pct;
-    pw->cap_set.settings = settings;
-    
-    setenv("XDG_RUNTIME_DIR", bus_sender_runtime_dir(), 1);
-    
+static int create_stream(pw_data_t *pw) {
     const struct spa_pod *params;
     uint8_t buffer[1024];
     struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
     
-    pw->loop = pw_loop_new(NULL);
-    pw->stream = pw_stream_new_simple(pw->loop,
-                                      "clightd-camera-pw",
-                                      pw_properties_new(
-                                          PW_KEY_MEDIA_TYPE, "Video",
-                                          PW_KEY_MEDIA_CATEGORY, "Capture",
-                                          PW_KEY_MEDIA_ROLE, "Camera",
-                                          NULL),
-                                      &stream_events,
-                                      pw);
+    /*
+     * Streams live on monitor core, connected to the pipewire daemon of CLIGHTD_PIPEWIRE_RUNTIME_DIR:
+     * Sensor methods callers' XDG_RUNTIME_DIR is never used, thus their credentials are not filled.
+     */
+    pw->stream = pw_stream_new(pw_mon.core,
+                               "clightd-camera-pw",
+                               pw_properties_new(
+                                   PW_KEY_MEDIA_TYPE, "Video",
+                                   PW_KEY_MEDIA_CATEGORY, "Capture",
+                                   PW_KEY_MEDIA_ROLE, "Camera",
+                                   NULL));
+    if (!pw->stream) {
+        return -1;
+    }
+    spa_zero(pw->stream_listener);
+    pw_stream_add_listener(pw->stream, &pw->stream_listener, &stream_events, pw);
+    
     build_format(&b, &params);
     int res;
     if ((res = pw_stream_connect(pw->stream,
         PW_DIRECTION_INPUT,
         pw->node.id,
-        PW_STREAM_FLAG_AUTOCONNECT |    /* try to automatically connect this stream */
-        PW_STREAM_FLAG_MAP_BUFFERS,     /* mmap the buffer data for us */
+        PW_STREAM_FLAG_AUTOCONNECT,     /* try to automatically connect this stream; buffers are mapped by map_luma() */
         &params, 1))                    /* extra parameters, see above */ < 0) {
         
         fprintf(stderr, "Can't connect: %s\n", spa_strerror(res));
+        destroy_stream(pw);
+        return -1;
+    }
+    INFO("Created stream for node %s.\n", pw->node.objpath);
+    return 0;
+}
+
+static void destroy_stream(pw_data_t *pw) {
+    if (pw->stream) {
+        spa_hook_remove(&pw->stream_listener);
+        pw_stream_destroy(pw->stream);
+        pw->stream = NULL;
+    }
+}
+
+static int capture(void *dev, double *pct, uint64_t *ts, const int num_captures, char *settings) {
+    pw_data_t *pw = (pw_data_t *)dev;
+    pw->cap_set.pct = pct;
+    pw->cap_set.ts = ts;
+    pw->cap_set.num_captures = num_captures;
+    pw->cap_set.settings = settings;
+    /* Stream callbacks may have flagged an error while idle: start clean */
+    pw->cap_set.capture_idx = 0;
+    pw->cap_set.with_err = false;
+    
+    if (pw->stream && pw_stream_get_state(pw->stream, NULL) == PW_STREAM_STATE_ERROR) {
+        INFO("Stream for node %s is in error state; recreating it.\n", pw->node.objpath);
+        destroy_stream(pw);
+    }
+    
+    if (!pw->stream) {
+        /* Stream starts streaming as soon as it gets negotiated */
+        if (create_stream(pw) != 0) {
+            return 0;
+        }
     } else {
-        /* Use a 2s timeout to avoid locking on the pw_loop_iterate() loop! */
-        struct timespec timeout = { .tv_sec = 2 };
-        struct spa_source *timer = pw_loop_add_timer(pw->loop, on_timeout, pw);
-        pw_loop_update_timer(pw->loop, timer, &timeout, NULL, false);
-        pw_loop_enter(pw->loop);
-        while (pw->cap_set.capture_idx < num_captures && !pw->cap_set.with_err) {
-            if (pw_loop_iterate(pw->loop, -1) < 0) {
-                break;
-            }
+        INFO("Reusing stream for node %s.\n", pw->node.objpath);
+        pw_stream_set_active(pw->stream, true);
+    }
+    
+    /* 
+     * Iterate monitor loop (already entered): its fd is registered in our main loop,
+     * but we need to synchronously wait for frames here.
+     * Use a 2s timeout to avoid locking on the pw_loop_iterate() loop! 
+     */
+    pw_data_t *last = last_recved;
+    struct timespec timeout = { .tv_sec = 2 };
+    struct spa_source *timer = pw_loop_add_timer(pw_mon.loop, on_timeout, pw);
+    pw_loop_update_timer(pw_mon.loop, timer, &timeout, NULL, false);
+    while (pw->cap_set.capture_idx < num_captures && !pw->cap_set.with_err) {
+        if (pw_loop_iterate(pw_mon.loop, -1) < 0) {
+            break;
         }
-        pw_loop_leave(pw->loop);
-        pw_loop_destroy_source(pw->loop, timer);
-        // restore_camera_settings(pw); // TODO
     }
-    unsetenv("XDG_RUNTIME_DIR");
+    pw_loop_destroy_source(pw_mon.loop, timer);
+    // restore_camera_settings(pw); // TODO
+    
+    if (pw->cap_set.with_err) {
+        /* Recreate stream from scratch next time */
+        destroy_stream(pw);
+    } else {
+        pw_stream_set_active(pw->stream, false);
+    }
+    
+    /* Registry events were dispatched while capturing: notify Sensor */
+    if (last_recved && last_recved != last) {
+        uint64_t u = 1;
+        write(efd, &u, sizeof(uint64_t));
+    }
     return pw->cap_set.capture_idx;
 }
 
+static int capture_interval(void *dev, char *settings) {
+    /* Frames are paced by the stream itself */
+    return 0;
+}
+
 // Stolen from https://github.com/PipeWire/pipewire/blob/master/spa/plugins/v4l2/v4l2-utils.c#L1049
 static inline enum spa_prop control_to_prop_id(uint32_t control_id) {
     switch (control_id) {
@@ -3,6 +3,7 @@
 #include <sensor.h>
 #include <udev.h>
 #include <libusb.h>
+#include <sys/epoll.h>
 
 /* This overrides define in als.h. Define it before include. */
 #define ALS_INTERVAL        500 // ms
@@ -19,6 +20,7 @@
 #define YOCTO_IFACE           0
 
 #define YOCTO_MAX_TRIES       20
+#define YOCTO_MAX_AGE         4     // intervals; older values mean device stopped streaming
 
 #define YOCTO_CONF_RESET      0
 #define YOCTO_CONF_START      1
@@ -89,6 +91,11 @@ typedef union {
     } confpkt;
 } USB_Packet;
 
+/* 
+ * A session is started as soon as the device is found (at startup, when plugged or when looked up),
+ * and keeps it claimed and streaming until it is unplugged:
+ * an asynchronous interrupt transfer is always pending and stores latest received value.
+ */
 typedef struct {
     libusb_device_handle *hdl;
     struct libusb_config_descriptor *config;
@@ -96,18 +103,95 @@ typedef struct {
     uint8_t wrendp;
     int interval;
     enum usb_state st;
+    char *syspath;                  // device held by hdl
+    bool streaming;                 // session started
+    struct libusb_transfer *xfer;   // pending read transfer
+    bool xfer_active;               // xfer submitted and not yet completed
+    USB_Packet rbuf;
+    bool has_val;
+    double last_pct;
+    uint64_t last_ts;               // when last_pct was received
 } ylight_state;
 
 static bool get_dev_config(libusb_device *dev);
 static int init_usb_device(void);
 static int start_usb_device(USB_Packet *rpkt);
 static int destroy_usb_device(void);
+static int start_session(int interval);
+static void destroy_session(void);
+static void on_pollfd_added(int fd, short events, void *userdata);
+static void on_pollfd_removed(int fd, void *userdata);
 
 static struct udev_monitor *mon;
 static ylight_state state;
+static int usb_epfd = -1;   // epoll fd gathering libusb pollfds
 
 SENSOR(YOCTO_NAME);
 
+MODULE(YOCTO_NAME);
+
+static void module_pre_start(void) {
+    
+}
+
+static bool check(void) {
+    return true;
+}
+
+static bool evaluate(void) {
+    return true;
+}
+
+/*
+ * libusb may need POLLOUT on its fds (eg: usbfs ones),
+ * thus they are gathered in an epoll fd, that is polled for POLLIN by our main loop.
+ */
+static void init(void) {
+    usb_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (usb_epfd >= 0) {
+        const struct libusb_pollfd **fds = libusb_get_pollfds(NULL);
+        for (int i = 0; fds && fds[i]; i++) {
+            on_pollfd_added(fds[i]->fd, fds[i]->events, NULL);
+        }
+        libusb_free_pollfds(fds);
+        libusb_set_pollfd_notifiers(NULL, on_pollfd_added, on_pollfd_removed, NULL);
+        m_register_fd(usb_epfd, true, NULL);
+    } else {
+        fprintf(stderr, "Failed to create libusb epoll fd: %m\n");
+    }
+    
+    /* Start streaming from an already plugged device, if any */
+    void *dev = NULL;
+    fetch_dev(NULL, &dev);
+    if (dev) {
+        validate_dev(dev);
+        destroy_dev(dev);
+    }
+}
+
+static void receive(const msg_t *msg, const void *userdata) {
+    if (!msg->is_pubsub) {
+        /* Some libusb event is ready; do not block */
+        struct timeval tv = { 0 };
+        libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+    }
+}
+
+static void destroy(void) {
+    destroy_session();
+    libusb_set_pollfd_notifiers(NULL, NULL, NULL, NULL);
+}
+
+static void on_pollfd_added(int fd, short events, void *userdata) {
+    /* poll and epoll events share same values */
+    struct epoll_event ev = { .events = events, .data.fd = fd };
+    epoll_ctl(usb_epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void on_pollfd_removed(int fd, void *userdata) {
+    epoll_ctl(usb_epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
 static void _ctor_ init_libusb(void) {
     libusb_init(NULL);
 }
@@ -125,15 +209,37 @@ static bool get_dev_config(libusb_device *dev) {
 }
 
 static bool validate_dev(void *dev) {
+    const char *syspath = udev_device_get_syspath(dev);
+    if (state.streaming && !strcmp(state.syspath, syspath)) {
+        const char *action = udev_device_get_action(dev);
+        if (action && !strcmp(action, UDEV_ACTION_RM)) {
+            /* Device held by session has been removed */
+            destroy_session();
+            return true;
+        }
+        if (state.xfer_active) {
+            /* Device is already opened and validated by session */
+            return true;
+        }
+        /* Session broke; start a new one */
+        destroy_session();
+    }
+    
     const char *vendor_id = udev_device_get_sysattr_value(dev, YOCTO_PROPERTY);
     if (vendor_id && !strcmp(vendor_id, YOCTO_VENDORID)) {
         const char *product_id = udev_device_get_sysattr_value(dev, "idProduct");
-        if (product_id) {
+        if (product_id && !state.streaming) {
             int vendor = (int)strtol(vendor_id, NULL, 16); // hex
             int product = (int)strtol(product_id, NULL, 16); // hex
             state.hdl = libusb_open_device_with_vid_pid(NULL, vendor, product);
             if (state.hdl) {
-                return get_dev_config(libusb_get_device(state.hdl));
+                state.syspath = strdup(syspath);
+                /* Settings are not known yet: session uses default interval for its handshake */
+                if (get_dev_config(libusb_get_device(state.hdl)) && start_session(ALS_INTERVAL) == 0) {
+                    return true;
+                }
+                fprintf(stderr, "Failed to start '%s' session.\n", syspath);
+                destroy_session();
             }
         }
         /* Always return true if action is "remove", ie: when called by udev monitor */
@@ -144,7 +250,7 @@ static bool validate_dev(void *dev) {
 }
 
 static void fetch_dev(const char *interface, void **dev) {
-    const udev_match match = { .sysattr_key = YOCTO_PROPERTY, .sysattr_val = YOCTO_VENDORID };
+    const udev_match match = { .sysattr_key = YOCTO_PROPERTY, .sysattr_val = YOCTO_VENDORID, .cached = true };
     get_udev_device(interface, YOCTO_SUBSYSTEM, &match, NULL, (struct udev_device **)dev);
 }
 
@@ -159,13 +265,9 @@ static void fetch_props_dev(void *dev, const char **node, const char **action) {
 
 static void destroy_dev(void *dev) {
     udev_device_unref(dev);
-    if (state.hdl) {
-        libusb_close(state.hdl);
-        state.hdl = NULL;
-    }
-    if (state.config) {
-        libusb_free_config_descriptor(state.config);
-        state.config = NULL;
+    /* Session keeps the device opened until it is unplugged */
+    if (!state.streaming) {
+        destroy_session();
     }
 }
 
@@ -326,26 +428,111 @@ static int destroy_usb_device(void) {
     return ret;
 }
 
-static int capture(void *dev, double *pct, const int num_captures, char *settings) {
-    int interval;
-    parse_settings(settings, &interval);
-    int ctr = -ENODEV;
+static void on_transfer(struct libusb_transfer *t) {
+    switch (t->status) {
+        case LIBUSB_TRANSFER_COMPLETED: {
+            const int stream = state.rbuf.confpkt.head.stream;
+            if (t->actual_length == YOCTO_PKT_SIZE && 
+                stream != YOCTO_STREAM_NOTICE && stream != YOCTO_STREAM_NOTICE_V2) {
+                
+                double illuminance = atof((char *)&state.rbuf.data[3]);
+                state.last_pct = compute_value(illuminance);
+                state.last_ts = sensor_now_usec();
+                state.has_val = true;
+            }
+        }
+        /* fallthrough */
+        case LIBUSB_TRANSFER_TIMED_OUT:
+            if (libusb_submit_transfer(t) == 0) {
+                return;
+            }
+            break;
+        default:
+            INFO("Yocto transfer stopped: %d\n", t->status);
+            break;
+    }
+    state.xfer_active = false;
+}
+
+static int start_session(int interval) {
+    state.interval = interval;
+    USB_Packet rpkt = { 0 };
+    if (init_usb_device() != 0 || start_usb_device(&rpkt) != 0) {
+        return -1;
+    }
     
-    if (state.hdl) {
-        state.interval = interval;
-        USB_Packet rpkt = { 0 };
-        if (init_usb_device() == 0 && start_usb_device(&rpkt) == 0) {
-            ctr = 0;
-            for (int i = 0; i < num_captures; i++) {
-                int trans = 0;
-                libusb_interrupt_transfer(state.hdl, state.rdendp, (unsigned char *) &rpkt, YOCTO_PKT_SIZE, &trans, interval);
-                double illuminance = atof((char *)&rpkt.data[3]);
-                pct[ctr++] = compute_value(illuminance);
+    state.xfer = libusb_alloc_transfer(0);
+    if (!state.xfer) {
+        return -1;
+    }
+    libusb_fill_interrupt_transfer(state.xfer, state.hdl, state.rdendp, state.rbuf.data, YOCTO_PKT_SIZE, on_transfer, NULL, 0);
+    if (libusb_submit_transfer(state.xfer) != 0) {
+        return -1;
+    }
+    state.xfer_active = true;
+    state.streaming = true;
+    INFO("Yocto session started.\n");
+    return 0;
+}
+
+static void destroy_session(void) {
+    if (state.xfer) {
+        if (state.xfer_active && libusb_cancel_transfer(state.xfer) == 0) {
+            /* Wait for cancelled transfer callback */
+            for (int i = 0; i < YOCTO_MAX_TRIES && state.xfer_active; i++) {
+                struct timeval tv = { .tv_usec = 100 * 1000 };
+                libusb_handle_events_timeout_completed(NULL, &tv, NULL);
             }
         }
+        libusb_free_transfer(state.xfer);
+        state.xfer = NULL;
+    }
+    state.xfer_active = false;
+    state.streaming = false;
+    state.has_val = false;
+    
+    if (state.hdl) {
         destroy_usb_device();
+        libusb_close(state.hdl);
+        state.hdl = NULL;
+    }
+    if (state.config) {
+        libusb_free_config_descriptor(state.config);
+        state.config = NULL;
+    }
+    free(state.syspath);
+    state.syspath = NULL;
+}
+
+static int capture(void *dev, double *pct, uint64_t *ts, const int num_captures, char *settings) {
+    int interval;
+    parse_settings(settings, &interval);
+    
+    if (!state.streaming) {
+        return -ENODEV;
+    }
+    
+    /* 
+     * Never wait for the device: no samples until its first value is received,
+     * nor once it stopped streaming for a while.
+     */
+    int ctr = 0;
+    const uint64_t max_age = (uint64_t)YOCTO_MAX_AGE * (interval > 0 ? interval : ALS_INTERVAL) * 1000;
+    if (state.has_val && sensor_now_usec() - state.last_ts <= max_age) {
+        /* Latest value received by the streaming device */
+        for (; ctr < num_captures; ctr++) {
+            pct[ctr] = state.last_pct;
+            ts[ctr] = state.last_ts;
+        }
     }
     return ctr;
 }
 
+static int capture_interval(void *dev, char *settings) {
+    /* Device streams continuously: sample its latest value each interval ms */
+    int interval;
+    parse_settings(settings, &interval);
+    return interval;
+}
+
 #endif
@@ -1,6 +1,15 @@
 #include <udev.h>
+#include <module/map.h>
 
 static void get_first_matching_device(struct udev_device **dev, const char *subsystem, const udev_match *match);
+static void get_cached_matching_device(struct udev_device **dev, const char *subsystem, const udev_match *match);
+
+/* 
+ * Lookup key -> syspath of matching device ("" if none matched), 
+ * for udev_match with cached set.
+ * Avoids a full enumeration of subsystem for each lookup.
+ */
+static map_t *cache;
 
 int init_udev_monitor(const char *subsystem, struct udev_monitor **mon) {
     *mon = udev_monitor_new_from_netlink(udev, "udev");
@@ -59,12 +68,50 @@ static void get_first_matching_device(struct udev_device **dev, const char *subs
     udev_enumerate_unref(enumerate);
 }
 
+static void get_cached_matching_device(struct udev_device **dev, const char *subsystem, 
+                                       const udev_match *match) {
+    if (!cache) {
+        cache = map_new(true, free);
+    }
+    
+    char key[PATH_MAX + 1];
+    snprintf(key, sizeof(key), "%s|%s=%s|%s=%s|%d", subsystem, 
+             match->sysattr_key ? match->sysattr_key : "", match->sysattr_val ? match->sysattr_val : "",
+             match->prop_key ? match->prop_key : "", match->prop_val ? match->prop_val : "",
+             match->last_added);
+    
+    const char *syspath = map_get(cache, key);
+    if (syspath) {
+        if (syspath[0] == '\0') {
+            /* No matching device */
+            return;
+        }
+        *dev = udev_device_new_from_syspath(udev, syspath);
+        if (*dev) {
+            return;
+        }
+        /* Device went away before cache got invalidated */
+        map_remove(cache, key);
+    }
+    
+    get_first_matching_device(dev, subsystem, match);
+    map_put(cache, key, strdup(*dev ? udev_device_get_syspath(*dev) : ""));
+}
+
+void udev_cache_invalidate(void) {
+    map_clear(cache);
+}
+
 void get_udev_device(const char *interface, const char *subsystem, const udev_match *match,
                             sd_bus_error **ret_error, struct udev_device **dev) {
     *dev = NULL;
     /* if no interface is specified, try to get first matching device */
     if (interface == NULL || interface[0] == '\0') {
-        get_first_matching_device(dev, subsystem, match);
+        if (match && match->cached) {
+            get_cached_matching_device(dev, subsystem, match);
+        } else {
+            get_first_matching_device(dev, subsystem, match);
+        }
     } else {
         char *name = strrchr(interface, '/');
         if (name) {
@@ -75,6 +122,7 @@ void get_udev_device(const char *interface, const char *subsystem, const udev_ma
             // Try it as device ATTR{name}
             static udev_match m = { .sysattr_key = "name" };
             m.sysattr_val = interface;
+            m.cached = match && match->cached;
             return get_udev_device(NULL, subsystem, &m, ret_error, dev);
         }
     }
@@ -113,3 +161,7 @@ void udev_devices_foreach(const char *subsystem, const udev_match *match,
      /* Free the enumerator object */
     udev_enumerate_unref(enumerate);
 }
+
+static void _dtor_ udev_cache_dtor(void) {
+    map_free(cache);
+}
@@ -7,10 +7,12 @@ typedef struct {
     const char *prop_key;
     const char *prop_val;
     bool last_added;
+    bool cached;        // cache lookup result until udev_cache_invalidate() is called
 } udev_match;
 
 int init_udev_monitor(const char *subsystem, struct udev_monitor **mon);
 void get_udev_device(const char *interface, const char *subsystem, const udev_match *match,
                      sd_bus_error **ret_error, struct udev_device **dev);
+void udev_cache_invalidate(void);
 void udev_devices_foreach(const char *subsystem, const udev_match *match,  
                           int (*cb)(struct udev_device *dev, void *userdata), void *userdata);